@@ -322,6 +322,51 @@ int conf_key_exists(const conf_t conf, const char *section, int index, const cha
 	return(_conf_find(conf, section, index, key) == NULL ? 0 : -1);
 }
 
+const char *conf_next_key(const conf_t conf, const char *section, int index, const char *key, const char **value)
+{
+	const char *s;
+	
+	if(key == NULL)
+	{
+		/* Find the start of the section */
+		s = conf;
+		
+		while(section != NULL && *s)
+		{
+			if(*s == '[')
+			{
+				/* The start of a new section */
+				if(strcasecmp(s + 1, section) == 0 && index-- == 0)
+				{
+					s += strlen(s) + 1;
+					break;
+				}
+				
+				s += strlen(s) + 1;
+			}
+			else
+			{
+				/* Skip this key value pair */
+				s += strlen(s) + 1;
+				s += strlen(s) + 1;
+			}
+		}
+	}
+	else
+	{
+		/* Skip over the previous key value pair */
+		s = key + strlen(key) + 1;
+		s += strlen(s) + 1;
+	}
+	
+	/* Stop at the end of the file or section */
+	if(*s == '\0' || *s == '[') return(NULL);
+	
+	if(value) *value = s + strlen(s) + 1;
+	
+	return(s);
+}
+
 const char *conf_str(const conf_t conf, const char *section, int index, const char *key, const char *defaultval)
 {
 	const char *v = _conf_find(conf, section, index, key);
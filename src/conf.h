@@ -58,11 +58,15 @@ typedef char* conf_t;
  * 
  * If the same key appears multiple times within a section, only the first
  * matching instance is used.
+ * 
+ * conf_next_key() walks the keys of a single section in file order. Pass
+ * NULL as the key to get the first one. Returns NULL after the last key.
 */
 
 extern conf_t conf_loadfile(const char *filename);
 extern int conf_section_exists(const conf_t conf, const char *section, int index);
 extern int conf_key_exists(const conf_t conf, const char *section, int index, const char *key);
+extern const char *conf_next_key(const conf_t conf, const char *section, int index, const char *key, const char **value);
 extern const char *conf_str(const conf_t conf, const char *section, int index, const char *key, const char *defaultval);
 extern long int conf_int(const conf_t conf, const char *section, int index, const char *key, long int defaultval);
 extern double conf_double(const conf_t conf, const char *section, int index, const char *key, double defaultval);
@@ -0,0 +1,309 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "control.h"
+
+/* Largest reply to a single command */
+#define REPLY_LEN 16384
+
+static void _drop(control_client_t *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+static void _accept(control_t *s)
+{
+	int fd, i;
+	
+	fd = accept4(s->fd, NULL, NULL, SOCK_CLOEXEC);
+	if(fd < 0) return;
+	
+	for(i = 0; i < CONTROL_CLIENTS; i++)
+	{
+		if(s->clients[i].fd < 0)
+		{
+			s->clients[i].fd = fd;
+			s->clients[i].len = 0;
+			return;
+		}
+	}
+	
+	/* Too many clients */
+	close(fd);
+}
+
+static int _send(control_client_t *c, const char *msg)
+{
+	size_t len = strlen(msg);
+	ssize_t r;
+	
+	/* Never wait on a client. One that isn't reading its
+	 * replies fills the socket buffer, and is dropped */
+	while(len > 0)
+	{
+		r = send(c->fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return(-1);
+		
+		msg += r;
+		len -= r;
+	}
+	
+	return(0);
+}
+
+static void _read(control_t *s, control_client_t *c, char *reply)
+{
+	char *line, *e;
+	ssize_t r;
+	int n;
+	
+	r = read(c->fd, c->line + c->len, CONTROL_LINE - 1 - c->len);
+	if(r <= 0)
+	{
+		_drop(c);
+		return;
+	}
+	
+	c->len += r;
+	c->line[c->len] = '\0';
+	
+	/* Run each complete command */
+	for(line = c->line; (e = strchr(line, '\n')) != NULL; line = e + 1)
+	{
+		*e = '\0';
+		if(e > line && e[-1] == '\r') e[-1] = '\0';
+		
+		*reply = '\0';
+		s->handler(s->arg, line, reply, REPLY_LEN);
+		
+		if(_send(c, reply) != 0)
+		{
+			_drop(c);
+			return;
+		}
+	}
+	
+	/* Keep any partial command for the next read */
+	n = c->len - (line - c->line);
+	memmove(c->line, line, n);
+	c->len = n;
+	
+	if(c->len == CONTROL_LINE - 1)
+	{
+		c->len = 0;
+		
+		if(_send(c, "ERR Line too long\n") != 0)
+		{
+			_drop(c);
+		}
+	}
+}
+
+static int _unlink_stale(const struct sockaddr_un *addr)
+{
+	struct stat st;
+	int fd, r;
+	
+	if(lstat(addr->sun_path, &st) != 0)
+	{
+		if(errno == ENOENT) return(0);
+		perror(addr->sun_path);
+		return(-1);
+	}
+	
+	if(!S_ISSOCK(st.st_mode))
+	{
+		fprintf(stderr, "%s: Exists and is not a socket\n", addr->sun_path);
+		return(-1);
+	}
+	
+	/* A socket left behind by an earlier run refuses connections */
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) return(-1);
+	
+	r = connect(fd, (const struct sockaddr *) addr, sizeof(*addr));
+	close(fd);
+	
+	if(r == 0)
+	{
+		fprintf(stderr, "%s: Control socket is already in use\n", addr->sun_path);
+		return(-1);
+	}
+	
+	if(unlink(addr->sun_path) != 0)
+	{
+		perror(addr->sun_path);
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static void *_thread(void *arg)
+{
+	control_t *s = arg;
+	struct pollfd fds[CONTROL_CLIENTS + 1];
+	char *reply;
+	int i;
+	
+	reply = malloc(REPLY_LEN);
+	if(!reply) return(NULL);
+	
+	while(!atomic_load(&s->quit))
+	{
+		fds[0].fd = s->fd;
+		fds[0].events = POLLIN;
+		
+		for(i = 0; i < CONTROL_CLIENTS; i++)
+		{
+			/* Negative descriptors are ignored by poll() */
+			fds[i + 1].fd = s->clients[i].fd;
+			fds[i + 1].events = POLLIN;
+			fds[i + 1].revents = 0;
+		}
+		
+		/* Wake up regularly to check for quit */
+		if(poll(fds, CONTROL_CLIENTS + 1, 100) <= 0)
+		{
+			continue;
+		}
+		
+		for(i = 0; i < CONTROL_CLIENTS; i++)
+		{
+			if(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				_read(s, &s->clients[i], reply);
+			}
+		}
+		
+		if(fds[0].revents & POLLIN)
+		{
+			_accept(s);
+		}
+	}
+	
+	free(reply);
+	
+	return(NULL);
+}
+
+int control_open(control_t *s, const char *path, control_handler_t handler, void *arg)
+{
+	struct sockaddr_un addr;
+	int i;
+	
+	memset(s, 0, sizeof(control_t));
+	s->fd = -1;
+	s->handler = handler;
+	s->arg = arg;
+	
+	for(i = 0; i < CONTROL_CLIENTS; i++)
+	{
+		s->clients[i].fd = -1;
+	}
+	
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "%s: Control socket path is too long\n", path);
+		return(-1);
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	s->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(s->fd < 0)
+	{
+		perror("socket");
+		return(-1);
+	}
+	
+	/* Replace any socket left behind by an earlier run */
+	if(_unlink_stale(&addr) != 0)
+	{
+		close(s->fd);
+		s->fd = -1;
+		return(-1);
+	}
+	
+	/* Only the owner may send commands */
+	if(bind(s->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+	   chmod(path, 0600) != 0 ||
+	   listen(s->fd, CONTROL_CLIENTS) != 0)
+	{
+		perror(path);
+		close(s->fd);
+		s->fd = -1;
+		return(-1);
+	}
+	
+	s->path = strdup(path);
+	
+	if(pthread_create(&s->thread, NULL, _thread, s) != 0)
+	{
+		perror("pthread_create");
+		control_close(s);
+		return(-1);
+	}
+	
+	s->started = 1;
+	
+	return(0);
+}
+
+void control_close(control_t *s)
+{
+	int i;
+	
+	if(!s->path) return;
+	
+	if(s->started)
+	{
+		atomic_store(&s->quit, 1);
+		pthread_join(s->thread, NULL);
+	}
+	
+	for(i = 0; i < CONTROL_CLIENTS; i++)
+	{
+		if(s->clients[i].fd >= 0)
+		{
+			_drop(&s->clients[i]);
+		}
+	}
+	
+	close(s->fd);
+	s->fd = -1;
+	
+	unlink(s->path);
+	free(s->path);
+	s->path = NULL;
+}
+
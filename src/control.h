@@ -0,0 +1,61 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* A local (unix domain) control socket. Clients send one command per
+ * line. Each command is passed to the handler on the control thread,
+ * one at a time, and its reply written back. A reply is any number of
+ * lines ending with "OK" or "ERR <reason>".
+*/
+
+#define CONTROL_CLIENTS 8
+#define CONTROL_LINE 1024
+
+typedef void (*control_handler_t)(void *arg, char *line, char *reply, size_t len);
+
+typedef struct {
+	int fd;
+	int len;
+	char line[CONTROL_LINE];
+} control_client_t;
+
+typedef struct {
+	
+	char *path;
+	int fd;
+	control_client_t clients[CONTROL_CLIENTS];
+	
+	control_handler_t handler;
+	void *arg;
+	
+	pthread_t thread;
+	int started;
+	atomic_int quit;
+	
+} control_t;
+
+extern int control_open(control_t *s, const char *path, control_handler_t handler, void *arg);
+extern void control_close(control_t *s);
+
+#endif
+
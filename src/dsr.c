@@ -18,6 +18,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
 #include "bits.h"
 #include "dsr.h"
 
@@ -94,6 +96,12 @@ static const char *_charset[256] = {
 	"","","","","","","","","","","","","","","","",
 };
 
+/* Reverse lookup of the character set, from the unicode code point.
+ * All the characters are in the BMP, and only a few pages are used */
+static uint8_t _charset_page[256];
+static int16_t _charset_rev[8][256];
+static pthread_once_t _charset_once = PTHREAD_ONCE_INIT;
+
 typedef struct {
 	int number;
 	const char *programme_type;
@@ -255,29 +263,50 @@ static void _ziframe(uint8_t *b, uint8_t sc_l, uint8_t sc_r, uint32_t pi)
 	bits_write_int(b, 42, pi, 22);
 }
 
-extern void dsr_encode(dsr_t *s, uint8_t *block, const int16_t *audio)
+static uint32_t _idle(const dsr_channel_t *channels)
 {
-	int i, j, x;
-	uint8_t a[40], b[40];
-	uint8_t c[8][10];
-	uint8_t zi[16][8];
-	int16_t as, *ac;
-	const int16_t *ap;
-	const _comp_range_t *scale[32];
-	int blockno;
+	uint32_t idle = 0;
+	int i;
 	
-	/* Calculate the audio block number */
-	blockno = s->frame >> 6;
+	/* Unallocated channels, the encoder supplies their audio */
+	for(i = 0; i < 32; i++)
+	{
+		if(channels[i].mode == 4) idle |= 1UL << i;
+	}
 	
-	/* Calculate the scale for each channel */
-	for(ap = audio, i = 0; i < 32; i++)
+	return(idle);
+}
+
+static uint32_t _scale(const _comp_range_t *scale[32], const int16_t *audio, uint32_t idle)
+{
+	const int16_t *ap;
+	uint32_t quiet = idle;
+	int16_t as;
+	int i, x;
+	
+	/* Calculate the scale for each channel. Returns the
+	 * channels whose audio doesn't change over the block */
+	for(ap = audio, i = 0; i < 32; i++, ap += 64)
 	{
 		/* Default to the minimum scale */
 		scale[i] = _ranges;
 		
-		for(x = 0; x < 64; x++, ap++)
+		/* Idle channels are always -1, the minimum scale */
+		if(idle & (1UL << i)) continue;
+		
+		/* Silent or held channels need only one sample testing */
+		for(x = 1; x < 64 && ap[x] == ap[0]; x++);
+		
+		if(x == 64)
 		{
-			as = (*ap < 0 ? ~*ap : *ap);
+			quiet |= 1UL << i;
+			x = 63;
+		}
+		else x = 0;
+		
+		for(; x < 64; x++)
+		{
+			as = (ap[x] < 0 ? ~ap[x] : ap[x]);
 			while(as & scale[i]->mask)
 			{
 				scale[i]++;
@@ -285,25 +314,63 @@ extern void dsr_encode(dsr_t *s, uint8_t *block, const int16_t *audio)
 		}
 	}
 	
-	/* Encode the ZI frames */
-	for(i = 0; i < 16; i++)
-	{
-		_ziframe(zi[i], scale[i * 2 + 0]->shift, scale[i * 2 + 1]->shift, 0);
-	}
+	return(quiet);
+}
+
+static void _load_delay(int16_t *ac, const int16_t *audio, const _comp_range_t *scale[32], uint32_t idle)
+{
+	int i, x;
 	
-	/* Load the new audio data into the delay buffer (+4ms) */
-	ac = &s->delay[(((blockno + 2) & 3) * 0x800) & 0x1FFF];
 	for(x = 0; x < 64; x++)
 	{
 		for(i = 0; i < 32; i++, ac++)
 		{
-			*ac = audio[i * 64 + x] << scale[i]->shift;
+			*ac = (idle & (1UL << i) ? -1 : audio[i * 64 + x]) << scale[i]->shift;
 			*ac >>= 2;
 		}
 	}
+}
+
+static void _encode(unsigned int frame, int16_t *delay, uint32_t *quiet, const dsr_sa_t *sa, const dsr_sa_t *next, uint8_t *block, const int16_t *audio)
+{
+	int i, j, x;
+	uint8_t a[40], b[40];
+	uint8_t c[8][10];
+	uint8_t cq[8][10];
+	uint8_t zi[16][8];
+	int16_t *ac;
+	const _comp_range_t *scale[32];
+	uint32_t idle, q;
+	int blockno;
+	
+	/* Calculate the audio block number */
+	blockno = frame >> 6;
+	
+	/* Calculate the scale for each channel */
+	idle = sa->idle;
+	q = _scale(scale, audio, idle);
+	
+	/* Encode the ZI frames */
+	for(i = 0; i < 16; i++)
+	{
+		_ziframe(zi[i], scale[i * 2 + 0]->shift, scale[i * 2 + 1]->shift, 0);
+	}
+	
+	/* Load the new audio data into the delay buffer (+4ms) */
+	_load_delay(&delay[(((blockno + 2) & 3) * 0x800) & 0x1FFF], audio, scale, idle);
+	quiet[(blockno + 2) & 3] = q;
 	
 	/* Move the audio pointer back to previously written samples (-4ms) */
-	ac = &s->delay[((blockno & 3) * 0x800) & 0x1FFF];
+	ac = &delay[((blockno & 3) * 0x800) & 0x1FFF];
+	q = quiet[blockno & 3];
+	
+	/* The 77-bit blocks of idle or silent channels are the
+	 * same in every frame, apart from the ZI bits */
+	for(j = 0; j < 8; j++)
+	{
+		if(((q >> (j * 4)) & 15) != 15) continue;
+		_77block(cq[j], ac[j * 4 + 0], ac[j * 4 + 1], ac[j * 4 + 2], ac[j * 4 + 3], 0, 0);
+	}
 	
 	/* Generate the 64 main frame pairs for this audio block */
 	for(i = 0; i < 64; i++)
@@ -317,18 +384,29 @@ extern void dsr_encode(dsr_t *s, uint8_t *block, const int16_t *audio)
 		bits_write_uint(b, 0, ~0x712, 11);
 		
 		/* Special service bit */
-		j = s->frame + 16; /* SA bits are offset by 16 bits from the audio blocks */
-		bits_write_uint(a, 11, s->sa[(j >> 6) & 127][(j >> 3) & 7] >> (7 - (j & 7)), 1);
+		j = frame + 16; /* SA bits are offset by 16 bits from the audio blocks */
+		x = (j >> 6) & 127;
+		bits_write_uint(a, 11, (x ? sa : next)->sa[x][(j >> 3) & 7] >> (7 - (j & 7)), 1);
 		bits_write_uint(b, 11, 0, 1);
 		
 		/* Generate the 77-bit blocks */
 		for(j = 0; j < 8; j++, ac += 4)
 		{
-			_77block(c[j],
-				ac[0], ac[1], ac[2], ac[3],
-				zi[j * 2 + 0][i >> 3] >> (7 - (i & 7)),
-				zi[j * 2 + 1][i >> 3] >> (7 - (i & 7))
-			);
+			if(((q >> (j * 4)) & 15) == 15)
+			{
+				memcpy(c[j], cq[j], 10);
+				bits_write_uint(c[j], 63, zi[j * 2 + 0][i >> 3] >> (7 - (i & 7)), 1);
+				bits_write_uint(c[j], 64, zi[j * 2 + 1][i >> 3] >> (7 - (i & 7)), 1);
+			}
+			else
+			{
+				_77block(c[j],
+					ac[0], ac[1], ac[2], ac[3],
+					zi[j * 2 + 0][i >> 3] >> (7 - (i & 7)),
+					zi[j * 2 + 1][i >> 3] >> (7 - (i & 7))
+				);
+			}
+			
 			c[j][9] >>= 3;
 		}
 		
@@ -354,11 +432,152 @@ extern void dsr_encode(dsr_t *s, uint8_t *block, const int16_t *audio)
 			block[1] = (_ileave[a[j]] << 1) | (_ileave[b[j]] << 0);
 		}
 		
-		s->frame++;
+		frame++;
 	}
 }
 
-void dsr_encode_ps(uint8_t *dst, const char *src)
+static int _sa_begin(dsr_t *s, int n, const dsr_sa_t **sa, const dsr_sa_t **next)
+{
+	int v, k;
+	
+	v = atomic_load_explicit(&s->sa_state, memory_order_acquire);
+	*sa = *next = &s->sa[v & 1];
+	
+	/* The last block of each superframe starts sending the SA
+	 * bits of the next. A waiting update is switched in there */
+	k = 127 - ((s->frame >> 6) & 127);
+	if(k >= n || !(v & 2)) return(n);
+	
+	/* Hold the shadow table until the switch is complete */
+	if(!atomic_compare_exchange_strong_explicit(&s->sa_state, &v, v | 4,
+		memory_order_acquire, memory_order_relaxed)) return(n);
+	
+	*next = &s->sa[(v & 1) ^ 1];
+	
+	return(k);
+}
+
+static void _sa_end(dsr_t *s, int k, int n)
+{
+	int v;
+	
+	if(k >= n) return;
+	
+	/* The shadow is now in use, and the old table is free for updates */
+	v = atomic_load_explicit(&s->sa_state, memory_order_relaxed);
+	atomic_store_explicit(&s->sa_state, (v & 1) ^ 1, memory_order_release);
+}
+
+extern void dsr_encode(dsr_t *s, uint8_t *block, const int16_t *audio)
+{
+	const dsr_sa_t *sa, *next;
+	int k;
+	
+	k = _sa_begin(s, 1, &sa, &next);
+	_encode(s->frame, s->delay, s->quiet, sa, next, block, audio);
+	_sa_end(s, k, 1);
+	
+	s->frame += 64;
+}
+
+typedef struct {
+	dsr_t *s;
+	uint8_t *blocks;
+	const int16_t *audio;
+	const dsr_sa_t *sa;
+	const dsr_sa_t *next;
+	int k;
+} _batch_t;
+
+static const dsr_sa_t *_batch_sa(const _batch_t *b, int k)
+{
+	/* The SA table for block k of the batch */
+	return(k > b->k ? b->next : b->sa);
+}
+
+static void _encode_batch_block(void *arg, int k)
+{
+	_batch_t *b = arg;
+	const _comp_range_t *scale[32];
+	int16_t delay[8192];
+	uint32_t quiet[4];
+	int16_t *ac;
+	int blockno;
+	
+	/* Each block only looks back at the audio from two blocks
+	 * earlier. Rebuild that part of the delay buffer locally */
+	blockno = (b->s->frame >> 6) + k;
+	ac = &delay[((blockno & 3) * 0x800) & 0x1FFF];
+	
+	if(k >= 2)
+	{
+		quiet[blockno & 3] = _scale(scale, &b->audio[(k - 2) * 2048], _batch_sa(b, k - 2)->idle);
+		_load_delay(ac, &b->audio[(k - 2) * 2048], scale, _batch_sa(b, k - 2)->idle);
+	}
+	else
+	{
+		memcpy(ac, &b->s->delay[((blockno & 3) * 0x800) & 0x1FFF], sizeof(int16_t) * 0x800);
+		quiet[blockno & 3] = b->s->quiet[blockno & 3];
+	}
+	
+	_encode(b->s->frame + k * 64, delay, quiet, _batch_sa(b, k), _batch_sa(b, k + 1), &b->blocks[k * 5120], &b->audio[k * 2048]);
+}
+
+void dsr_encode_batch(dsr_t *s, uint8_t *blocks, const int16_t *audio, int n, workers_t *workers)
+{
+	const _comp_range_t *scale[32];
+	_batch_t b = { s, blocks, audio, NULL, NULL, 0 };
+	int j, k;
+	
+	if(!workers || n <= 1)
+	{
+		for(k = 0; k < n; k++)
+		{
+			dsr_encode(s, &blocks[k * 5120], &audio[k * 2048]);
+		}
+		
+		return;
+	}
+	
+	b.k = _sa_begin(s, n, &b.sa, &b.next);
+	
+	workers_run(workers, _encode_batch_block, &b, n);
+	
+	/* Leave the delay buffer as it would be after encoding
+	 * the blocks one at a time */
+	for(k = (n > 4 ? n - 4 : 0); k < n; k++)
+	{
+		j = ((s->frame >> 6) + k + 2) & 3;
+		s->quiet[j] = _scale(scale, &audio[k * 2048], _batch_sa(&b, k)->idle);
+		_load_delay(&s->delay[(j * 0x800) & 0x1FFF], &audio[k * 2048], scale, _batch_sa(&b, k)->idle);
+	}
+	
+	_sa_end(s, b.k, n);
+	
+	s->frame += n * 64;
+}
+
+static void _charset_init(void)
+{
+	uint32_t c;
+	int i, p;
+	
+	/* Unused pages point to page 0, which is left empty */
+	memset(_charset_rev, 0xFF, sizeof(_charset_rev));
+	
+	/* Work backwards so the first of any duplicates is used */
+	for(p = 1, i = 255; i >= 0; i--)
+	{
+		if(!_charset[i][0]) continue;
+		
+		c = _utf8next(_charset[i], NULL);
+		if(!_charset_page[c >> 8]) _charset_page[c >> 8] = p++;
+		
+		_charset_rev[_charset_page[c >> 8]][c & 0xFF] = i;
+	}
+}
+
+static void _encode_ps(uint8_t *dst, const char *src)
 {
 	uint32_t c;
 	int i, j;
@@ -368,13 +587,10 @@ void dsr_encode_ps(uint8_t *dst, const char *src)
 		c = _utf8next(src, &src);
 		
 		/* Lookup DSR character set */
-		for(j = 0; j < 256; j++)
-		{
-			if(c == _utf8next(_charset[j], NULL)) break;
-		}
+		j = c > 0xFFFF ? -1 : _charset_rev[_charset_page[c >> 8]][c & 0xFF];
 		
 		/* Write character, or ' ' if not recognised */
-		dst[i] = (j == 256 ? ' ' : j);
+		dst[i] = (j < 0 ? ' ' : j);
 	}
 	
 	for(; i < 8; i++)
@@ -383,6 +599,24 @@ void dsr_encode_ps(uint8_t *dst, const char *src)
 	}
 }
 
+void dsr_encode_ps(uint8_t *dst, const char *src)
+{
+	pthread_once(&_charset_once, _charset_init);
+	_encode_ps(dst, src);
+}
+
+void dsr_encode_ps_batch(uint8_t (*dst)[8], const char *const *src, int n)
+{
+	int i;
+	
+	pthread_once(&_charset_once, _charset_init);
+	
+	for(i = 0; i < n; i++)
+	{
+		_encode_ps(dst[i], src[i]);
+	}
+}
+
 void dsr_decode_ps(char *dst, const uint8_t *src)
 {
 	int i;
@@ -393,54 +627,99 @@ void dsr_decode_ps(char *dst, const uint8_t *src)
 	}
 }
 
-void dsr_update_sa(dsr_t *s)
+static void _sa_row(uint8_t *sa, const dsr_channel_t *channels, int i)
 {
-	dsr_channel_t *c;
-	int i, b;
+	const dsr_channel_t *c = &channels[(i & 7) * 4];
+	int b;
+	
+	sa[0] = 0x05;
+	sa[1] = i & 7 ? 0xFF : 0xCF;
 	
-	/* Generate the SAÜ/PA (programme information) frames */
-	for(i = 0; i < 56; i++)
+	if(i < 56)
+	{
+		/* SAÜ/PA (programme information) frames */
+		sa[2] = _par[(c[0].type << 4) | (c[0].music << 3) | (c[0].mode << 1)];
+		sa[3] = _par[(c[1].type << 4) | (c[1].music << 3) | (c[1].mode << 1)];
+		sa[4] = _par[(c[2].type << 4) | (c[2].music << 3) | (c[2].mode << 1)];
+		sa[5] = _par[(c[3].type << 4) | (c[3].music << 3) | (c[3].mode << 1)];
+		sa[6] = 0x00; /* DI */
+		sa[7] = 0x00; /* DII */
+	}
+	else if(i < 64)
+	{
+		/* SAÜ/LB (zero byte) frames */
+		memset(&sa[2], 0, 6);
+	}
+	else
 	{
-		c = &s->channels[(i & 7) * 4];
+		/* SAÜ/SK (programme source) frames */
+		b = (i - 64) >> 3;
 		
-		s->sa[i][0] = 0x05;
-		s->sa[i][1] = i & 7 ? 0xFF : 0xCF;
-		s->sa[i][2] = _par[(c[0].type << 4) | (c[0].music << 3) | (c[0].mode << 1)];
-		s->sa[i][3] = _par[(c[1].type << 4) | (c[1].music << 3) | (c[1].mode << 1)];
-		s->sa[i][4] = _par[(c[2].type << 4) | (c[2].music << 3) | (c[2].mode << 1)];
-		s->sa[i][5] = _par[(c[3].type << 4) | (c[3].music << 3) | (c[3].mode << 1)];
-		s->sa[i][6] = 0x00; /* DI */
-		s->sa[i][7] = 0x00; /* DII */
+		sa[2] = c[0].name[b];
+		sa[3] = c[1].name[b];
+		sa[4] = c[2].name[b];
+		sa[5] = c[3].name[b];
+		sa[6] = 0x00; /* EI */
+		sa[7] = 0x00; /* EII */
 	}
+}
+
+void dsr_update_sa(dsr_t *s)
+{
+	dsr_sa_t *t;
+	int i;
+	
+	/* Rebuild the table in use, before the encoder starts */
+	t = &s->sa[atomic_load(&s->sa_state) & 1];
 	
-	/* Generate the SAÜ/LB (zero byte) frames */
-	for(; i < 64; i++)
+	for(i = 0; i < 128; i++)
 	{
-		s->sa[i][0] = 0x05;
-		s->sa[i][1] = i & 7 ? 0xFF : 0xCF;
-		s->sa[i][2] = 0x00;
-		s->sa[i][3] = 0x00;
-		s->sa[i][4] = 0x00;
-		s->sa[i][5] = 0x00;
-		s->sa[i][6] = 0x00;
-		s->sa[i][7] = 0x00;
+		_sa_row(t->sa[i], s->channels, i);
 	}
 	
-	/* Generate the SAÜ/SK (programme source) frames */
-	for(; i < 128; i++)
+	t->idle = _idle(s->channels);
+}
+
+void dsr_set_channel(dsr_t *s, int channel, const dsr_channel_t *c)
+{
+	dsr_sa_t *t;
+	int v, i;
+	
+	/* Take back the shadow table if it's still waiting to be used */
+	for(;;)
 	{
-		c = &s->channels[(i & 7) * 4];
-		b = (i - 64) >> 3;
+		v = atomic_load_explicit(&s->sa_state, memory_order_acquire);
+		
+		if(v & 4)
+		{
+			/* The encoder is switching to it right now */
+			sched_yield();
+			continue;
+		}
 		
-		s->sa[i][0] = 0x05;
-		s->sa[i][1] = i & 7 ? 0xFF : 0xCF;
-		s->sa[i][2] = c[0].name[b];
-		s->sa[i][3] = c[1].name[b];
-		s->sa[i][4] = c[2].name[b];
-		s->sa[i][5] = c[3].name[b];
-		s->sa[i][6] = 0x00; /* EI */
-		s->sa[i][7] = 0x00; /* EII */
+		if(atomic_compare_exchange_weak_explicit(&s->sa_state, &v, v & 1,
+			memory_order_acquire, memory_order_relaxed)) break;
 	}
+	
+	/* Start from the table in use, unless there are changes waiting */
+	t = &s->sa[(v & 1) ^ 1];
+	if(!(v & 2)) memcpy(t, &s->sa[v & 1], sizeof(dsr_sa_t));
+	
+	s->channels[channel].type = c->type;
+	s->channels[channel].music = c->music;
+	s->channels[channel].mode = c->mode;
+	memcpy(s->channels[channel].name, c->name, 8);
+	
+	/* Only the rows carrying this channel's group need rebuilding */
+	for(i = channel >> 2; i < 128; i += 8)
+	{
+		_sa_row(t->sa[i], s->channels, i);
+	}
+	
+	t->idle = _idle(s->channels);
+	
+	/* The encoder switches to it at the next superframe */
+	atomic_store_explicit(&s->sa_state, (v & 1) | 2, memory_order_release);
 }
 
 void dsr_init(dsr_t *s)
@@ -449,6 +728,12 @@ void dsr_init(dsr_t *s)
 	
 	memset(s, 0, sizeof(dsr_t));
 	
+	/* The delay buffer starts out silent */
+	for(i = 0; i < 4; i++)
+	{
+		s->quiet[i] = 0xFFFFFFFF;
+	}
+	
 	/* Initial channel setup (all disabled) */
 	for(i = 0; i < 32; i++)
 	{
@@ -19,6 +19,8 @@
 #define _DSR_H
 
 #include <stdint.h>
+#include <stdatomic.h>
+#include "workers.h"
 
 #define DSR_SAMPLE_RATE 32000
 #define DSR_SYMBOL_RATE 10240000
@@ -31,21 +33,36 @@ typedef struct {
 	void *arg;
 } dsr_channel_t;
 
+typedef struct {
+	uint8_t sa[128][8];
+	uint32_t idle;
+} dsr_sa_t;
+
 typedef struct {
 	
 	dsr_channel_t channels[32];
 	
-	int frame;
-	uint8_t sa[128][8];
+	unsigned int frame;
+	
+	/* The SA table in use and a shadow copy for updates. Bit 0 of
+	 * sa_state is the table in use, bit 1 is set while the shadow
+	 * waits for the next superframe, bit 2 while switching to it */
+	dsr_sa_t sa[2];
+	atomic_int sa_state;
+	
 	int16_t delay[8192];
+	uint32_t quiet[4];
 	
 } dsr_t;
 
 extern void dsr_frames(dsr_t *s, uint8_t *a, uint8_t *b);
 extern void dsr_encode(dsr_t *s, uint8_t *block, const int16_t *audio);
+extern void dsr_encode_batch(dsr_t *s, uint8_t *blocks, const int16_t *audio, int n, workers_t *workers);
 extern void dsr_encode_ps(uint8_t *dst, const char *src);
+extern void dsr_encode_ps_batch(uint8_t (*dst)[8], const char *const *src, int n);
 extern void dsr_decode_ps(char *dst, const uint8_t *src);
 extern void dsr_update_sa(dsr_t *s);
+extern void dsr_set_channel(dsr_t *s, int channel, const dsr_channel_t *c);
 extern void dsr_init(dsr_t *s);
 
 #endif
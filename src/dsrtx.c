@@ -18,15 +18,75 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <getopt.h>
+#include <time.h>
+#include <math.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "dsr.h"
 #include "conf.h"
 #include "src.h"
 #include "rf.h"
+#include "pipeline.h"
+#include "control.h"
+
+/* Blocks from the start for the encoder and modulator
+ * to settle, these are never recorded into the cache */
+#define CACHE_WARMUP 3
+
+typedef struct _dsrtx_t dsrtx_t;
+
+/* A batch of 2ms blocks on its way through the pipeline */
+typedef struct {
+	
+	/* Channel-major audio, blk points either here or
+	 * into the shared memory multiplex input */
+	int16_t *audio;
+	int16_t *blk;
+	
+	/* Encoded bitstream */
+	uint8_t *block;
+	int blocks;
+	
+	/* Position of the first block, and if it's replayed from the cache */
+	uint64_t pos;
+	int cached;
+	
+	/* The period to record, if this job is part of the recording,
+	 * and set if a source ran dry and was padded with silence */
+	int record;
+	int underran;
+	
+	/* Modulated I/Q samples */
+	int16_t *iq;
+	int iq_len;
+	
+} _job_t;
 
 typedef struct {
 	
+	dsrtx_t *s;
+	pthread_t thread;
+	int started;
+	
+	/* The channel section and its position in the multiplex */
+	int index;
+	int channel;
+	
+	/* Set once the source has been opened, or failed to */
+	atomic_int ready;
+	
+	/* A replacement source waiting for the source stage to
+	 * switch it in, and the source it replaced */
+	_Atomic(src_t *) swap;
+	_Atomic(src_t *) retired;
+	
+} _opener_t;
+
+struct _dsrtx_t {
+	
 	/* DSR bitstream encoder */
 	dsr_t dsr;
 	
@@ -44,246 +104,1765 @@ typedef struct {
 	const char *antenna;
 	int live;
 	
+	/* Source prefetch workers */
+	src_pool_t pool;
+	double source_buffer;
+	
+	/* Shared memory multiplex input, and the channels taken from it */
+	src_shm_t mux;
+	uint8_t from_mux[32];
+	
+	/* Sources are opened in the background. The configuration
+	 * is kept for reopening them later */
+	conf_t conf;
+	_opener_t openers[32];
+	
+	/* Local control socket, and the changes made through it. Commands
+	 * and configuration reloads are run one at a time */
+	const char *control_path;
+	control_t control;
+	pthread_mutex_t control_mutex;
+	
+	/* Reload the configuration on SIGHUP */
+	const char *conffile;
+	pthread_t reload_thread;
+	int reload_started;
+	atomic_int reload_quit;
+	char *input[32];
+	atomic_uint mute;
+	_Atomic uint64_t sent;
+	struct timespec started;
+	
+	/* Transmit pipeline */
+	pipeline_t pipeline;
+	int pipeline_depth;
+	int cpu[4];
+	
+	/* Range of blocks to render, end is 0 to run forever */
+	uint64_t start;
+	uint64_t end;
+	uint64_t pos;
+	
+	/* Stop once every source has ended */
+	int stop_eof;
+	int eof;
+	
+	/* Blocks per job, and the threads encoding them */
+	int batch;
+	workers_t encode_workers;
+	int encode_threads;
+	
+	/* Threads shared by the modulator */
+	workers_t modulate_workers;
+	int modulate_threads;
+	
+	/* When every source repeats, one whole period of the output is
+	 * kept and replayed rather than encoded and modulated again.
+	 * The source stage finds the period and marks the jobs to record */
+	int iq_cache;
+	int iq_cache_period;
+	double iq_cache_size;
+	int cache_checked;
+	int cache_period;
+	unsigned long cache_underruns;
+	
+	/* The recording belongs to the output stage. The start and
+	 * length are fixed once cache_ready is set to replay */
+	uint64_t cache_start;
+	int16_t *cache;
+	int cache_block;
+	int cache_bits;
+	int cache_len;
+	int cache_n;
+	int cache_phase;
+	
+	/* 0 while recording, 1 while replaying, -1 once stopped */
+	atomic_int cache_ready;
+	
+	/* Set when a change over the control socket ends the replay.
+	 * Encoding resumes after a whole number of periods */
+	atomic_int cache_stop;
+	int cache_replaying;
+	uint64_t cache_resume;
+	
 	/* Verbose flag */
 	int verbose;
 	
-} dsrtx_t;
-
-volatile int _abort = 0;
-
-static void _sigint_callback_handler(int signum)
-{
-	fprintf(stderr, "Caught signal %d\n", signum);
+};
+
+volatile int _abort = 0;
+
+static void _sigint_callback_handler(int signum)
+{
+	fprintf(stderr, "Caught signal %d\n", signum);
+	
+	if(_abort > 0)
+	{
+		exit(-1);
+	}
+	
+	_abort = 1;
+}
+
+static void print_usage(void)
+{
+	printf(
+		"\n"
+		"Usage: dsrtx [options]\n"
+		"\n"
+		"  -c, --config <file>      Load configuration from file.\n"
+		"  -v, --verbose            Enable verbose output.\n"
+		"      --start <block>      Start the output at this 2ms block (default 0).\n"
+		"      --end <block>        Stop before this 2ms block (default never).\n"
+		"      --blocks <n>         Render n 2ms blocks from the start.\n"
+		"      --duration <secs>    Render this many seconds from the start.\n"
+		"      --eof                Stop once every source has ended.\n"
+		"\n"
+	);
+}
+
+/* Options that don't change the decoded audio of a source */
+static const char *_source_exclude[] = {
+	"channel", "mode", "name", "program_type", "secondary_type",
+	"music", "adaptive", "latency", "share", NULL
+};
+
+/* Options that don't need the channel's source reopening */
+static const char *_channel_exclude[] = {
+	"name", "program_type", "secondary_type", "music", NULL
+};
+
+static int _section_key(char *key, size_t len, conf_t conf, int i, const char **exclude)
+{
+	const char *k, *v;
+	int j, l;
+	
+	/* Describe a channel section by every option in it,
+	 * leaving out those in the exclude list */
+	*key = '\0';
+	
+	for(k = conf_next_key(conf, "channel", i, NULL, &v); k; k = conf_next_key(conf, "channel", i, k, &v))
+	{
+		for(j = 0; exclude[j] && strcasecmp(k, exclude[j]) != 0; j++);
+		if(exclude[j]) continue;
+		
+		l = strlen(key);
+		if(snprintf(key + l, len - l, "%s=%s\n", k, v) >= len - l)
+		{
+			/* Too long to describe, don't share this one */
+			return(-1);
+		}
+	}
+	
+	return(0);
+}
+
+static void *_open_src(dsrtx_t *s, conf_t conf, int i, const char *input)
+{
+	src_t *src, *p;
+	const char *v;
+	char key[1024];
+	double frequency[SRC_TONE_MAX];
+	int latency;
+	int share;
+	char *e;
+	int n;
+	int r;
+#ifdef HAVE_FFMPEG
+	int map_l, map_r;
+#endif
+	
+	src = calloc(sizeof(src_t), 1);
+	if(!src)
+	{
+		perror("calloc");
+		return(NULL);
+	}
+	
+	/* Channels with identical sources share a single decoder. An
+	 * input given over the control socket opens a fresh one */
+	share = !input && conf_bool(conf, "channel", i, "share", 1) &&
+	        _section_key(key, sizeof(key), conf, i, _source_exclude) == 0;
+	
+	if(!input) input = conf_str(conf, "channel", i, "input", NULL);
+	
+	v = conf_str(conf, "channel", i, "type", "rawaudio");
+	
+	if(share && src_shared_attach(src, key) == 0)
+	{
+		/* Already open for another channel */
+		share = 0;
+	}
+	else if(strcasecmp(v, "rawaudio") == 0)
+	{
+		v = input;
+		if(!v)
+		{
+			fprintf(stderr, "Warning: Missing input filename\n");
+			free(src);
+			return(NULL);
+		}
+		
+		r = src_rawaudio_open(
+			src,
+			v,
+			conf_bool(conf, "channel", i, "exec", 0),
+			conf_int(conf, "channel", i, "channels", conf_bool(conf, "channel", i, "stereo", 1) ? 2 : 1),
+			conf_bool(conf, "channel", i, "repeat", 0),
+			conf_int(conf, "channel", i, "rate", SRC_SAMPLE_RATE),
+			conf_str(conf, "channel", i, "format", "s16"),
+			s->pool.blocking ? 0 : conf_double(conf, "channel", i, "stall", 0.1),
+			s->pool.blocking ? 0 : conf_double(conf, "channel", i, "stall_restart", 5)
+		);
+		if(r != 0)
+		{
+			fprintf(stderr, "Warning: Failed to open '%s'\n", v);
+			free(src);
+			return(NULL);
+		}
+	}
+	else if(strcasecmp(v, "tone") == 0)
+	{
+		/* One or more comma separated frequencies */
+		v = conf_str(conf, "channel", i, "frequency", "0");
+		
+		for(n = 0; n < SRC_TONE_MAX; n++)
+		{
+			frequency[n] = strtod(v, &e);
+			if(e == v) break;
+			for(v = e; *v == ' ' || *v == ','; v++);
+		}
+		
+		r = src_tone_open(
+			src,
+			conf_str(conf, "channel", i, "signal", n > 1 ? "multitone" : "sine"),
+			frequency,
+			n,
+			conf_double(conf, "channel", i, "level", 0),
+			conf_double(conf, "channel", i, "duration", 10),
+			conf_int(conf, "channel", i, "seed", 1)
+		);
+		if(r != 0)
+		{
+			fprintf(stderr, "Warning: Failed to open tone source\n");
+			free(src);
+			return(NULL);
+		}
+	}
+	else if(strcasecmp(v, "playlist") == 0)
+	{
+		v = input;
+		if(!v)
+		{
+			fprintf(stderr, "Warning: Missing playlist filename\n");
+			free(src);
+			return(NULL);
+		}
+		
+#ifdef HAVE_FFMPEG
+		r = strcasecmp(conf_str(conf, "channel", i, "decoder", "ffmpeg"), "ffmpeg") == 0;
+#else
+		r = 0;
+#endif
+		
+		r = src_playlist_open(
+			src,
+			v,
+			conf_bool(conf, "channel", i, "repeat", 0),
+			r,
+			conf_int(conf, "channel", i, "channels", conf_bool(conf, "channel", i, "stereo", 1) ? 2 : 1),
+			conf_int(conf, "channel", i, "rate", SRC_SAMPLE_RATE),
+			conf_str(conf, "channel", i, "format", "s16"),
+			conf_double(conf, "channel", i, "ahead", 10),
+			conf_double(conf, "channel", i, "cache", 600)
+		);
+		if(r != 0)
+		{
+			fprintf(stderr, "Warning: Failed to open '%s'\n", v);
+			free(src);
+			return(NULL);
+		}
+	}
+	else if(strcasecmp(v, "rtp") == 0)
+	{
+		r = src_rtp_open(
+			src,
+			input,
+			conf_str(conf, "channel", i, "port", "5004"),
+			conf_str(conf, "channel", i, "format", "L16"),
+			conf_int(conf, "channel", i, "channels", 2),
+			conf_int(conf, "channel", i, "rate", 48000),
+			conf_double(conf, "channel", i, "jitter", 0.02)
+		);
+		if(r != 0)
+		{
+			fprintf(stderr, "Warning: Failed to open RTP source\n");
+			free(src);
+			return(NULL);
+		}
+	}
+#ifdef HAVE_FFMPEG
+	else if(strcasecmp(v, "ffmpeg") == 0)
+	{
+		v = input;
+		if(!v)
+		{
+			fprintf(stderr, "Warning: Missing input filename/URL\n");
+			free(src);
+			return(NULL);
+		}
+		
+		if(conf_str(conf, "channel", i, "stream", NULL) ||
+		   conf_str(conf, "channel", i, "map", NULL))
+		{
+			/* Pick one or two channels out of a multi-channel stream,
+			 * "map = 2,3" or "map = 4" for mono */
+			r = sscanf(conf_str(conf, "channel", i, "map", "0,1"), "%d,%d", &map_l, &map_r);
+			if(r < 1)
+			{
+				fprintf(stderr, "Warning: Invalid channel map\n");
+				free(src);
+				return(NULL);
+			}
+			
+			if(r == 1) map_r = map_l;
+			
+			r = src_ffmpeg_open_map(
+				src,
+				v,
+				conf_int(conf, "channel", i, "stream", -1),
+				map_l,
+				map_r,
+				s->source_buffer * SRC_SAMPLE_RATE * 4
+			);
+		}
+		else
+		{
+			r = src_ffmpeg_open(src, v);
+		}
+		
+		if(r != 0)
+		{
+			fprintf(stderr, "Warning: Failed to open '%s'\n", v);
+			free(src);
+			return(NULL);
+		}
+	}
+#endif
+	else
+	{
+		fprintf(stderr, "Warning: Unrecognised input type '%s'\n", v);
+		free(src);
+		return(NULL);
+	}
+	
+	if(share)
+	{
+		/* The first channel to open this source, register it. The ring
+		 * covers how far ahead each channel's prefetch may read */
+		p = calloc(sizeof(src_t), 1);
+		if(!p || src_shared_open(p, key, src, s->source_buffer * SRC_SAMPLE_RATE * 4) != 0)
+		{
+			fprintf(stderr, "Warning: Failed to share source\n");
+			src_close(src);
+			free(src);
+			free(p);
+			return(NULL);
+		}
+		
+		free(src);
+		src = p;
+	}
+	
+	/* Sources running on their own clock can be resampled to hold the
+	 * buffer at a fixed latency. Only useful for live outputs */
+	latency = 0;
+	
+	if(conf_bool(conf, "channel", i, "adaptive", 0) && !s->pool.blocking)
+	{
+		latency = conf_double(conf, "channel", i, "latency", 0.2) * SRC_SAMPLE_RATE;
+	}
+	
+	/* Decode the source ahead of the encoder on the worker pool */
+	p = calloc(sizeof(src_t), 1);
+	if(!p || src_prefetch_open(p, &s->pool, src, s->source_buffer * SRC_SAMPLE_RATE, latency) != 0)
+	{
+		fprintf(stderr, "Warning: Failed to start source prefetch\n");
+		src_close(src);
+		free(src);
+		free(p);
+		return(NULL);
+	}
+	
+	free(src);
+	
+	return(p);
+}
+
+static void *_opener(void *arg)
+{
+	_opener_t *op = arg;
+	dsrtx_t *s = op->s;
+	
+	s->dsr.channels[op->channel].arg = _open_src(s, s->conf, op->index, NULL);
+	atomic_store_explicit(&op->ready, 1, memory_order_release);
+	
+	return(NULL);
+}
+
+static void _wait_sources(dsrtx_t *s)
+{
+	int c;
+	
+	for(c = 0; c < 32; c++)
+	{
+		if(s->openers[c].started)
+		{
+			pthread_join(s->openers[c].thread, NULL);
+			s->openers[c].started = 0;
+		}
+	}
+}
+
+static void _load_channels(dsrtx_t *s, conf_t conf, dsr_channel_t *ch, int *index, uint8_t *mux)
+{
+	const char *v;
+	int i, c;
+	
+	for(c = 0; c < 32; c++)
+	{
+		index[c] = -1;
+	}
+	
+	for(i = 0; conf_section_exists(conf, "channel", i); i++)
+	{
+		c = conf_int(conf, "channel", i, "channel", 0);
+		if(c < 1 || c > 16)
+		{
+			/* Knowing the conf file line number would be handy here */
+			fprintf(stderr, "Warning: Invalid or missing channel number. Skipping\n");
+			continue;
+		}
+		c = (c - 1) * 2;
+		
+		v = conf_str(conf, "channel", i, "mode", "s");
+		
+		if(strcasecmp(v, "s") == 0)
+		{
+			/* Stereo channel. Test if both L/R channels are free */
+			if(ch[c + 0].mode != 4 ||
+			   ch[c + 1].mode != 4)
+			{
+				fprintf(stderr, "Warning: Channel %02d/S is already allocated. Skipping\n", (c >> 1) + 1);
+				continue;
+			}
+			
+			/* Set the L channel parameters */
+			dsr_encode_ps(ch[c].name, conf_str(conf, "channel", i, "name", ""));
+			ch[c].type = conf_int(conf, "channel", i, "program_type", 0);
+			ch[c].music = conf_bool(conf, "channel", i, "music", 0) ? 1 : 0;
+			ch[c].mode = 1;
+			
+			/* Set the R channel parameters */
+			dsr_encode_ps(ch[c + 1].name, conf_str(conf, "channel", i, "name", ""));
+			ch[c + 1].type = conf_int(conf, "channel", i, "secondary_type", conf_int(conf, "channel", i, "program_type", 0));
+			ch[c + 1].music = 0;
+			ch[c + 1].mode = 2;
+		}
+		else if(strcasecmp(v, "a") == 0 ||
+		        strcasecmp(v, "b") == 0)
+		{
+			/* Mono A/B channel */
+			if(*v == 'b' || *v == 'B') c++;
+			
+			/* Test if this channel is free */
+			if(ch[c].mode != 4)
+			{
+				fprintf(stderr, "Warning: Channel %02d/%c is already allocated. Skipping\n", (c >> 1) + 1, c & 1 ? 'B' : 'A');
+				continue;
+			}
+			
+			/* Set the channel parameters */
+			dsr_encode_ps(ch[c].name, conf_str(conf, "channel", i, "name", ""));
+			ch[c].type = conf_int(conf, "channel", i, "program_type", 0);
+			ch[c].music = conf_bool(conf, "channel", i, "music", 0) ? 1 : 0;
+			ch[c].mode = 1;
+		}
+		else
+		{
+			fprintf(stderr, "Warning: Unrecognised channel mode '%s'. Skipping\n", v);
+			continue;
+		}
+		
+		if(strcasecmp(conf_str(conf, "channel", i, "type", ""), "shm") == 0)
+		{
+			/* The audio for this channel is already at
+			 * its position in the multiplex input */
+			if(!s->mux.shm)
+			{
+				fprintf(stderr, "Warning: No multiplex input has been configured\n");
+				continue;
+			}
+			
+			mux[c] = 1;
+			if(!(c & 1) && ch[c + 1].mode == 2) mux[c + 1] = 1;
+			
+			continue;
+		}
+		
+		/* The section this channel's source is opened from */
+		index[c] = i;
+	}
+}
+
+const int _load_config(dsrtx_t *s, const char *filename)
+{
+	conf_t conf;
+	const char *v;
+	int index[32];
+	int c;
+	int r;
+	
+	/* Load configuration */
+	conf = conf_loadfile(filename);
+	if(!conf) return(-1);
+	
+	/* Load configuration for output */
+	s->output_type = strdup(conf_str(conf, "output", -1, "type", "hackrf"));
+	s->output = strdup(conf_str(conf, "output", -1, "output", ""));
+	
+	s->data_type = -1;
+	v = conf_str(conf, "output", -1, "data_type", "");
+	if(strcmp(v, "uint8") == 0)       s->data_type = RF_UINT8;
+	else if(strcmp(v, "int8") == 0)   s->data_type = RF_INT8;
+	else if(strcmp(v, "uint16") == 0) s->data_type = RF_UINT16;
+	else if(strcmp(v, "int16") == 0)  s->data_type = RF_INT16;
+	else if(strcmp(v, "int32") == 0)  s->data_type = RF_INT32;
+	else if(strcmp(v, "float") == 0)  s->data_type = RF_FLOAT;
+	else if(strcmp(v, "") == 0)       s->data_type = -1;
+	else
+	{
+		fprintf(stderr, "Error: Invalid data type '%s'.\n", v);
+		free(conf);
+		return(-1);
+	}
+	
+	s->sample_rate = conf_int(conf, "output", -1, "sample_rate", DSR_SYMBOL_RATE * 2);
+	s->frequency = conf_double(conf, "output", -1, "frequency", 0),
+	s->gain = conf_int(conf, "output", -1, "gain", 0);
+	s->amp = conf_int(conf, "output", -1, "amp", 0);
+	s->antenna = conf_str(conf, "output", -1, "antenna", NULL);
+	s->live = conf_bool(conf, "output", -1, "live", 0);
+	
+	/* Start the source prefetch workers. Offline outputs wait
+	 * for the sources rather than fill any gaps with silence */
+	s->source_buffer = conf_double(conf, NULL, -1, "source_buffer", 0.5);
+	
+	r = src_pool_init(
+		&s->pool,
+		conf_int(conf, NULL, -1, "source_threads", 4),
+		strcmp(s->output_type, "file") == 0 && !s->live
+	);
+	if(r != 0)
+	{
+		fprintf(stderr, "Error: Failed to start the source workers.\n");
+		free(conf);
+		return(-1);
+	}
+	
+	/* Transmit pipeline. A depth of 0 runs every stage on one thread */
+	s->pipeline_depth = conf_int(conf, "pipeline", -1, "depth", 4);
+	s->cpu[0] = conf_int(conf, "pipeline", -1, "source_cpu", -1);
+	s->cpu[1] = conf_int(conf, "pipeline", -1, "encode_cpu", -1);
+	s->cpu[2] = conf_int(conf, "pipeline", -1, "modulate_cpu", -1);
+	s->cpu[3] = conf_int(conf, "pipeline", -1, "output_cpu", -1);
+	s->modulate_threads = conf_int(conf, "pipeline", -1, "modulate_threads", 1);
+	s->encode_threads = conf_int(conf, "pipeline", -1, "encode_threads", 1);
+	
+	/* Blocks handled per job. Offline renders favour throughput,
+	 * live outputs keep the latency down. Each encoder thread
+	 * takes one block of a batch */
+	r = s->pool.blocking ? 16 : 1;
+	if(r < s->encode_threads) r = s->encode_threads;
+	
+	s->batch = conf_int(conf, "pipeline", -1, "batch", r);
+	
+	if(s->batch < 1 || s->batch > 64)
+	{
+		fprintf(stderr, "Warning: Batch size must be 1 to 64 blocks\n");
+		s->batch = s->batch < 1 ? 1 : 64;
+	}
+	
+	/* Replay a cached period of the output for repeating sources */
+	s->iq_cache = conf_bool(conf, "pipeline", -1, "iq_cache", 1);
+	s->iq_cache_period = conf_int(conf, "pipeline", -1, "iq_cache_period", 0);
+	s->iq_cache_size = conf_double(conf, "pipeline", -1, "iq_cache_size", 256);
+	
+	/* Open the shared memory multiplex input */
+	if(conf_section_exists(conf, "multiplex", -1))
+	{
+		v = conf_str(conf, "multiplex", -1, "layout", "planar");
+		
+		if(strcasecmp(v, "planar") == 0)           r = SRC_SHM_PLANAR;
+		else if(strcasecmp(v, "interleaved") == 0) r = SRC_SHM_INTERLEAVED;
+		else
+		{
+			fprintf(stderr, "Error: Invalid multiplex layout '%s'.\n", v);
+			free(conf);
+			return(-1);
+		}
+		
+		r = src_shm_open(
+			&s->mux,
+			conf_str(conf, "multiplex", -1, "input", "/dsrtx"),
+			r,
+			conf_int(conf, "multiplex", -1, "blocks", 64),
+			s->pool.blocking
+		);
+		if(r != 0)
+		{
+			fprintf(stderr, "Error: Failed to open the multiplex input.\n");
+			free(conf);
+			return(-1);
+		}
+	}
+	
+	/* Load configuration for each channel */
+	s->conf = conf;
+	_load_channels(s, conf, s->dsr.channels, index, s->from_mux);
+	
+	for(c = 0; c < 32; c++)
+	{
+		if(index[c] < 0) continue;
+		
+		/* Open the audio source in the background. The channel
+		 * plays silence until it's ready */
+		s->openers[c].s = s;
+		s->openers[c].index = index[c];
+		s->openers[c].channel = c;
+		
+		if(pthread_create(&s->openers[c].thread, NULL, _opener, &s->openers[c]) == 0)
+		{
+			s->openers[c].started = 1;
+		}
+		else
+		{
+			_opener(&s->openers[c]);
+		}
+	}
+	
+	s->verbose = conf_bool(conf, NULL, -1, "verbose", s->verbose);
+	s->control_path = conf_str(conf, NULL, -1, "control", NULL);
+	
+	return(0);
+}
+
+static int _local_sources(dsrtx_t *s)
+{
+	int l;
+	
+	/* Any channel not taken from the multiplex input */
+	for(l = 0; l < 32; l++)
+	{
+		if(!s->from_mux[l] && s->dsr.channels[l].mode == 1) return(1);
+	}
+	
+	return(0);
+}
+
+static void _read_sources(dsrtx_t *s, int16_t *blk, unsigned int mute)
+{
+	int l, n;
+	
+	for(l = 0; l < 32; l++)
+	{
+		if(s->from_mux[l])
+		{
+			continue;
+		}
+		else if(s->dsr.channels[l].mode == 1 &&
+		        (!atomic_load_explicit(&s->openers[l].ready, memory_order_acquire) ||
+		         !s->dsr.channels[l].arg))
+		{
+			/* The source isn't open yet, or failed to open */
+			memset(&blk[l * 64], 0, sizeof(int16_t) * 64);
+			
+			if(!(l & 1) && s->dsr.channels[l + 1].mode == 2)
+			{
+				l++;
+				memset(&blk[l * 64], 0, sizeof(int16_t) * 64);
+			}
+		}
+		else if(s->dsr.channels[l & 30].mode == 1 &&
+		   s->dsr.channels[(l & 30) + 1].mode == 2)
+		{
+			n = src_read_block(s->dsr.channels[l].arg, &blk[l * 64], &blk[(l + 1) * 64], 64);
+			
+			if(n < 64)
+			{
+				/* Pad with silence at the end of the source */
+				memset(&blk[l * 64 + n], 0, sizeof(int16_t) * (64 - n));
+				memset(&blk[(l + 1) * 64 + n], 0, sizeof(int16_t) * (64 - n));
+			}
+			
+			l++;
+		}
+		else if(s->dsr.channels[l].mode == 1)
+		{
+			n = src_read_block(s->dsr.channels[l].arg, &blk[l * 64], NULL, 64);
+			
+			if(n < 64)
+			{
+				memset(&blk[l * 64 + n], 0, sizeof(int16_t) * (64 - n));
+			}
+		}
+		
+		/* Idle channels are filled in by the encoder */
+	}
+	
+	/* Sources keep playing while their channel is muted */
+	for(l = 0; mute; l++, mute >>= 1)
+	{
+		if(mute & 1) memset(&blk[l * 64], 0, sizeof(int16_t) * 64);
+	}
+}
+
+static int _sources_eof(dsrtx_t *s)
+{
+	int l;
+	
+	if(s->mux.shm && !src_shm_eof(&s->mux))
+	{
+		return(0);
+	}
+	
+	for(l = 0; l < 32; l++)
+	{
+		if(s->from_mux[l] || s->dsr.channels[l].mode != 1)
+		{
+			continue;
+		}
+		
+		/* Sources still opening haven't ended, ones that failed have */
+		if(!atomic_load_explicit(&s->openers[l].ready, memory_order_acquire))
+		{
+			return(0);
+		}
+		
+		if(s->dsr.channels[l].arg && !src_eof(s->dsr.channels[l].arg))
+		{
+			return(0);
+		}
+	}
+	
+	return(1);
+}
+
+static long _gcd(long a, long b)
+{
+	long t;
+	
+	while(b)
+	{
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	
+	return(a);
+}
+
+static int _cache_underruns(dsrtx_t *s)
+{
+	unsigned long n = 0;
+	int l;
+	
+	/* Total the underruns of every source, returns 1 if
+	 * there have been any since the last call */
+	for(l = 0; l < 32; l++)
+	{
+		if(s->dsr.channels[l].mode == 1)
+		{
+			n += src_prefetch_underruns(s->dsr.channels[l].arg);
+		}
+	}
+	
+	l = n != s->cache_underruns;
+	s->cache_underruns = n;
+	
+	return(l);
+}
+
+static void _cache_init(dsrtx_t *s)
+{
+	src_t *src;
+	long p, a;
+	size_t size;
+	int l;
+	
+	/* The SA data repeats every 128 blocks. The output repeats
+	 * at a multiple of that and the period of every source */
+	p = 128;
+	
+	for(l = 0; l < 32 && s->iq_cache_period <= 0; l++)
+	{
+		if(s->from_mux[l])
+		{
+			return;
+		}
+		
+		src = s->dsr.channels[l].arg;
+		if(s->dsr.channels[l].mode != 1 || !src)
+		{
+			/* Idle, silent or failed, these never change */
+			continue;
+		}
+		
+		if(src->period <= 0)
+		{
+			return;
+		}
+		
+		/* Whole blocks */
+		a = src->period / _gcd(src->period, 64);
+		p = p / _gcd(p, a) * a;
+		
+		if(p > INT32_MAX / 4) return;
+	}
+	
+	if(s->iq_cache_period > 0)
+	{
+		p = p / _gcd(p, s->iq_cache_period) * s->iq_cache_period;
+	}
+	
+	/* The modulated signal can take up to four times as long
+	 * again to come back around to the same phase */
+	size = sizeof(int16_t) * 40960 * s->qpsk.interpolation * p;
+	
+	if(size * 4 > s->iq_cache_size * 1024 * 1024)
+	{
+		if(s->verbose)
+		{
+			fprintf(stderr, "The output repeats every %ld blocks, too long to cache\n", p);
+		}
+		
+		return;
+	}
+	
+	/* The output stage allocates the recording once the first
+	 * job marked for it comes through */
+	s->cache_period = p;
+	_cache_underruns(s);
+}
+
+static void _cache_free(dsrtx_t *s)
+{
+	free(s->cache);
+	s->cache = NULL;
+	s->cache_len = 0;
+}
+
+static void _cache_abandon(dsrtx_t *s)
+{
+	int r = 0;
+	
+	/* Give up on the recording, the source stage stops marking jobs */
+	_cache_free(s);
+	atomic_compare_exchange_strong(&s->cache_ready, &r, -1);
+}
+
+static void _cache_record(dsrtx_t *s, _job_t *job)
+{
+	int16_t *cache;
+	int b, r;
+	
+	if(!s->cache)
+	{
+		s->cache_block = 40960 * s->qpsk.interpolation;
+		s->cache_bits = job->record;
+		s->cache_len = job->record;
+		s->cache = malloc(sizeof(int16_t) * s->cache_block * s->cache_bits);
+		
+		if(!s->cache)
+		{
+			_cache_abandon(s);
+			return;
+		}
+	}
+	
+	if(job->underran)
+	{
+		/* The silence a starved source was padded with would be
+		 * replayed forever, start the recording again after it */
+		if(s->cache_n > 0 && s->verbose)
+		{
+			fprintf(stderr, "A source underran, recording the cached period again\n");
+		}
+		
+		s->cache_n = 0;
+		s->cache_phase = 0;
+		s->cache_len = s->cache_bits;
+		
+		return;
+	}
+	
+	if(s->cache_n == 0)
+	{
+		s->cache_start = job->pos;
+	}
+	
+	for(b = 0; b < job->blocks && s->cache_n < s->cache_len; b++)
+	{
+		if(s->cache_n < s->cache_bits)
+		{
+			s->cache_phase += rf_qpsk_phase(&job->block[b * 5120], 40960);
+		}
+		
+		memcpy(&s->cache[s->cache_n * s->cache_block], &job->iq[b * s->cache_block], sizeof(int16_t) * s->cache_block);
+		s->cache_n++;
+		
+		if(s->cache_n == s->cache_bits)
+		{
+			/* The bitstream repeats from here. The signal repeats
+			 * once the phase has also come back around */
+			r = 4 / _gcd(s->cache_phase & 3, 4);
+			
+			if(r > 1)
+			{
+				cache = realloc(s->cache, sizeof(int16_t) * s->cache_block * s->cache_bits * r);
+				if(!cache)
+				{
+					_cache_abandon(s);
+					return;
+				}
+				
+				s->cache = cache;
+				s->cache_len = s->cache_bits * r;
+			}
+		}
+		
+		if(s->cache_n == s->cache_len)
+		{
+			/* Unless a change has stopped it in the meantime */
+			r = 0;
+			
+			if(atomic_compare_exchange_strong(&s->cache_ready, &r, 1) && s->verbose)
+			{
+				fprintf(stderr, "Replaying a cached period of %d blocks\n", s->cache_len);
+			}
+		}
+	}
+}
+
+static void _cache_replay(dsrtx_t *s, _job_t *job)
+{
+	int b, i, n;
+	
+	for(b = 0; b < job->blocks; b += n)
+	{
+		i = (job->pos + b - s->cache_start) % s->cache_len;
+		n = s->cache_len - i;
+		if(n > job->blocks - b) n = job->blocks - b;
+		
+		rf_write(&s->rf, &s->cache[i * s->cache_block], n * s->cache_block / 2);
+	}
+}
+
+static int _sources_ready(dsrtx_t *s)
+{
+	int l;
+	
+	for(l = 0; l < 32; l++)
+	{
+		if(s->dsr.channels[l].mode == 1 &&
+		   !atomic_load_explicit(&s->openers[l].ready, memory_order_acquire))
+		{
+			return(0);
+		}
+	}
+	
+	return(1);
+}
+
+static int _sources_primed(dsrtx_t *s)
+{
+	int l;
+	
+	for(l = 0; l < 32; l++)
+	{
+		if(s->dsr.channels[l].mode == 1 && !src_prefetch_primed(s->dsr.channels[l].arg))
+		{
+			return(0);
+		}
+	}
+	
+	return(1);
+}
+
+static int _cache_replaying(dsrtx_t *s, _job_t *job)
+{
+	uint64_t n;
+	int r;
+	
+	r = atomic_load(&s->cache_ready);
+	
+	if(r == 0 && atomic_load(&s->cache_stop))
+	{
+		/* Stop recording, and don't start again */
+		s->cache_checked = 1;
+		atomic_compare_exchange_strong(&s->cache_ready, &r, -1);
+	}
+	
+	if(r != 1) return(0);
+	
+	/* The encoder and modulator stopped at the first replayed block */
+	if(!s->cache_replaying)
+	{
+		s->cache_replaying = 1;
+		s->cache_resume = s->pos;
+	}
+	
+	if(atomic_load(&s->cache_stop))
+	{
+		/* They can pick up again where the period comes back round */
+		n = (s->pos - s->cache_resume) % s->cache_len;
+		
+		if(n == 0)
+		{
+			atomic_store(&s->cache_ready, -1);
+			return(0);
+		}
+		
+		n = s->cache_len - n;
+		if(job->blocks > n) job->blocks = n;
+	}
+	
+	return(1);
+}
+
+static int _stage_source(dsrtx_t *s, _job_t *job)
+{
+	int16_t *blk, *mux;
+	unsigned int mute;
+	src_t *src;
+	int b, l;
+	
+	if(_abort || s->eof)
+	{
+		return(-1);
+	}
+	
+	/* Stop at the end of the range */
+	job->blocks = s->batch;
+	
+	if(s->end > 0 && s->end - s->pos < job->blocks)
+	{
+		job->blocks = s->end - s->pos;
+		if(job->blocks == 0) return(-1);
+	}
+	
+	job->blk = job->audio;
+	job->pos = s->pos;
+	job->record = 0;
+	job->underran = 0;
+	job->cached = _cache_replaying(s, job);
+	
+	if(job->cached)
+	{
+		/* The output stage replays this from the cache */
+		s->pos += job->blocks;
+		return(0);
+	}
+	
+	/* Record from the first job read once every source has filled its
+	 * buffer. Until then they play silence not counted as underruns */
+	if(s->cache_period > 0 && s->pos >= s->start + CACHE_WARMUP &&
+	   atomic_load(&s->cache_ready) == 0 && _sources_primed(s))
+	{
+		job->record = s->cache_period;
+	}
+	
+	/* Switch in any sources replaced over the control socket or by a
+	 * reload, once the one replaced before them has been closed */
+	for(l = 0; l < 32; l++)
+	{
+		src = atomic_load_explicit(&s->openers[l].swap, memory_order_acquire);
+		if(!src || atomic_load_explicit(&s->openers[l].retired, memory_order_acquire)) continue;
+		
+		atomic_store_explicit(&s->openers[l].retired, s->dsr.channels[l].arg, memory_order_relaxed);
+		s->dsr.channels[l].arg = src;
+		atomic_store_explicit(&s->openers[l].swap, NULL, memory_order_release);
+	}
+	
+	for(b = 0; b < job->blocks; b++)
+	{
+		blk = &job->audio[b * 64 * 32];
+		mute = atomic_load_explicit(&s->mute, memory_order_relaxed);
+		
+		/* Take the block from the multiplex input when there is one.
+		 * In the planar layout a single block is used straight from
+		 * the read-only ring if nothing else is written into it. A
+		 * batch is copied out to keep the blocks together */
+		if(s->mux.shm)
+		{
+			mux = src_shm_read(&s->mux, blk);
+			
+			if(mux != blk && s->batch == 1 && mute == 0 && !_local_sources(s))
+			{
+				blk = job->blk = mux;
+			}
+			else if(mux != blk)
+			{
+				memcpy(blk, mux, sizeof(int16_t) * 64 * 32);
+				src_shm_release(&s->mux);
+			}
+		}
+		
+		/* Update the audio block */
+		_read_sources(s, blk, mute);
+		
+		/* End with the block that finished the last source */
+		if(s->stop_eof && _sources_eof(s))
+		{
+			s->eof = 1;
+			job->blocks = b + 1;
+		}
+	}
+	
+	s->pos += job->blocks;
+	
+	/* Flag any underruns while a period is recorded */
+	if(s->cache_period > 0 && atomic_load(&s->cache_ready) == 0 && _cache_underruns(s))
+	{
+		job->underran = 1;
+	}
+	
+	/* Look for repeating sources once they have all opened */
+	if(s->iq_cache && !s->cache_checked && _sources_ready(s))
+	{
+		s->cache_checked = 1;
+		_cache_init(s);
+	}
+	
+	return(0);
+}
+
+static int _stage_encode(dsrtx_t *s, _job_t *job)
+{
+	if(job->cached) return(0);
+	
+	/* Encode the next audio blocks (2ms each) */
+	dsr_encode_batch(&s->dsr, job->block, job->blk, job->blocks, s->encode_threads > 1 ? &s->encode_workers : NULL);
+	
+	/* Hand the block back to the multiplex input */
+	if(job->blk != job->audio)
+	{
+		src_shm_release(&s->mux);
+	}
+	
+	return(0);
+}
+
+static int _stage_modulate(dsrtx_t *s, _job_t *job)
+{
+	if(job->cached) return(0);
+	
+	job->iq_len = rf_qpsk_modulate(&s->qpsk, job->iq, job->block, 40960 * job->blocks);
+	
+	return(0);
+}
+
+static int _stage_output(dsrtx_t *s, _job_t *job)
+{
+	if(job->cached)
+	{
+		_cache_replay(s, job);
+		atomic_fetch_add_explicit(&s->sent, job->blocks, memory_order_relaxed);
+		return(0);
+	}
+	
+	rf_write(&s->rf, job->iq, job->iq_len);
+	atomic_fetch_add_explicit(&s->sent, job->blocks, memory_order_relaxed);
+	
+	/* Keep a copy while recording a period */
+	if(job->record && atomic_load(&s->cache_ready) == 0)
+	{
+		_cache_record(s, job);
+	}
+	
+	return(0);
+}
+
+static void _print_stats(dsrtx_t *s, double elapsed)
+{
+	const char *names[4] = { "source", "encode", "modulate", "output" };
+	uint64_t blocks = s->pos - s->start;
+	pipeline_stage_info_t *st;
+	int i;
+	
+	if(elapsed <= 0) elapsed = 1e-9;
+	
+	fprintf(stderr, "Rendered %" PRIu64 " blocks (%.3f s) in %.3f s, %.1f blocks/s, %.2f MS/s, %.2fx real time\n",
+		blocks, blocks * 64.0 / DSR_SAMPLE_RATE, elapsed,
+		blocks / elapsed,
+		blocks * 20480.0 * s->qpsk.interpolation / elapsed / 1e6,
+		blocks * 64.0 / DSR_SAMPLE_RATE / elapsed);
+	
+	fprintf(stderr, "CPU time:");
+	
+	for(i = 0; i < s->pipeline.nstages; i++)
+	{
+		st = &s->pipeline.stages[i];
+		fprintf(stderr, "%s %s %.3f s", i ? "," : "", names[i], st->cpu_time);
+		
+		if(i == 1 && s->encode_threads > 1)
+		{
+			fprintf(stderr, " (+%.3f s)", s->encode_workers.cpu_time);
+		}
+		else if(i == 2 && s->modulate_threads > 1)
+		{
+			fprintf(stderr, " (+%.3f s)", s->modulate_workers.cpu_time);
+		}
+	}
+	
+	fprintf(stderr, "\n");
+}
+
+static void _seek(dsrtx_t *s)
+{
+	_job_t *job = s->pipeline.jobs[0];
+	uint64_t end = s->end;
+	
+	/* The phase of the differential QPSK depends on every symbol
+	 * before it. Blocks before the start are still read and encoded
+	 * so the output matches a full render, only the modulation and
+	 * output are skipped */
+	s->end = s->start;
+	
+	while(!_abort && _stage_source(s, job) == 0)
+	{
+		_stage_encode(s, job);
+		rf_qpsk_skip(&s->qpsk, job->block, 40960 * job->blocks);
+	}
+	
+	s->end = end;
+}
+
+static void _free_pipeline(dsrtx_t *s)
+{
+	_job_t *job;
+	int i;
+	
+	for(i = 0; i < s->pipeline.njobs; i++)
+	{
+		job = s->pipeline.jobs[i];
+		if(!job) continue;
+		free(job->audio);
+		free(job->block);
+		free(job->iq);
+		free(job);
+	}
+	
+	free(s->pipeline.jobs);
+	pipeline_free(&s->pipeline);
+}
+
+static int _start_pipeline(dsrtx_t *s)
+{
+	_job_t *job;
+	void **jobs;
+	int i, n;
+	
+	/* A single job is enough when running on one thread */
+	n = s->pipeline_depth > 0 ? s->pipeline_depth : 1;
+	
+	jobs = calloc(n, sizeof(void *));
+	if(!jobs) return(-1);
+	
+	pipeline_init(&s->pipeline, jobs, n);
+	
+	for(i = 0; i < n; i++)
+	{
+		job = jobs[i] = calloc(1, sizeof(_job_t));
+		if(!job)
+		{
+			_free_pipeline(s);
+			return(-1);
+		}
+		
+		job->audio = malloc(sizeof(int16_t) * 64 * 32 * s->batch);
+		job->block = malloc(5120 * s->batch);
+		job->iq = malloc(sizeof(int16_t) * 40960 * s->qpsk.interpolation * s->batch);
+		
+		if(!job->audio || !job->block || !job->iq)
+		{
+			_free_pipeline(s);
+			return(-1);
+		}
+	}
+	
+	if(pipeline_add(&s->pipeline, (pipeline_stage_t) _stage_source, s, s->cpu[0]) != 0 ||
+	   pipeline_add(&s->pipeline, (pipeline_stage_t) _stage_encode, s, s->cpu[1]) != 0 ||
+	   pipeline_add(&s->pipeline, (pipeline_stage_t) _stage_modulate, s, s->cpu[2]) != 0 ||
+	   pipeline_add(&s->pipeline, (pipeline_stage_t) _stage_output, s, s->cpu[3]) != 0)
+	{
+		_free_pipeline(s);
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static void _reap_sources(dsrtx_t *s)
+{
+	src_t *src;
+	int c;
+	
+	/* Close sources the source stage has finished with */
+	for(c = 0; c < 32; c++)
+	{
+		src = atomic_exchange(&s->openers[c].retired, NULL);
+		if(src)
+		{
+			src_close(src);
+			free(src);
+		}
+	}
+}
+
+static char *_word(char **line)
+{
+	char *w;
+	
+	/* Split the next word off the line */
+	w = *line + strspn(*line, " \t");
+	if(*w == '\0') return(NULL);
+	
+	*line = w + strcspn(w, " \t");
+	if(**line) *(*line)++ = '\0';
+	
+	return(w);
+}
+
+static int _control_channel(dsrtx_t *s, const char *v, int *n)
+{
+	char *e;
+	long c;
+	
+	/* "3" for a stereo channel or mono A, "3b" for mono B */
+	c = strtol(v, &e, 10);
+	if(e == v || c < 1 || c > 16) return(-1);
+	
+	c = (c - 1) * 2;
+	
+	if(*e == 'a' || *e == 'A') e++;
+	else if(*e == 'b' || *e == 'B') { c++; e++; }
+	
+	if(*e != '\0' || s->dsr.channels[c].mode != 1) return(-1);
+	
+	/* Stereo changes apply to both halves */
+	*n = !(c & 1) && s->dsr.channels[c + 1].mode == 2 ? 2 : 1;
+	
+	return(c);
+}
+
+static void _control_set(dsrtx_t *s, int c, int type, int music, const uint8_t *name)
+{
+	dsr_channel_t ch;
+	
+	memset(&ch, 0, sizeof(dsr_channel_t));
+	ch.type = type;
+	ch.music = music;
+	ch.mode = s->dsr.channels[c].mode;
+	memcpy(ch.name, name, 8);
+	
+	dsr_set_channel(&s->dsr, c, &ch);
+}
+
+static const char *_control_source(dsrtx_t *s, int c, const char *input)
+{
+	_opener_t *op = &s->openers[c];
+	src_t *src;
+	
+	if(s->from_mux[c])
+	{
+		return("Channel is taken from the multiplex input");
+	}
+	
+	if(!atomic_load_explicit(&op->ready, memory_order_acquire))
+	{
+		return("Source is still opening");
+	}
+	
+	if(atomic_load_explicit(&op->swap, memory_order_acquire))
+	{
+		return("A previous change is still waiting");
+	}
+	
+	/* Open the new source here, the output carries on meanwhile */
+	src = _open_src(s, s->conf, op->index, input);
+	if(!src)
+	{
+		return("Failed to open the source");
+	}
+	
+	atomic_store_explicit(&op->swap, src, memory_order_release);
+	
+	return(NULL);
+}
+
+static int _reload(dsrtx_t *s)
+{
+	dsr_channel_t ch[32];
+	uint8_t mux[32];
+	int index[32];
+	char key[2][4096];
+	const char *err;
+	conf_t conf;
+	src_t *src;
+	int c, changes;
+	
+	_reap_sources(s);
+	
+	for(c = 0; c < 32; c++)
+	{
+		/* The sources still opening are reading the current configuration */
+		if(!s->from_mux[c] && s->dsr.channels[c].mode == 1 &&
+		   !atomic_load_explicit(&s->openers[c].ready, memory_order_acquire))
+		{
+			fprintf(stderr, "Warning: Sources are still opening, not reloading\n");
+			return(-1);
+		}
+	}
+	
+	conf = conf_loadfile(s->conffile);
+	if(!conf)
+	{
+		fprintf(stderr, "Warning: Failed to load configuration, not reloading\n");
+		return(-1);
+	}
+	
+	memset(ch, 0, sizeof(ch));
+	memset(mux, 0, sizeof(mux));
+	
+	for(c = 0; c < 32; c++)
+	{
+		ch[c].mode = 4;
+		ch[c].music = 1;
+	}
+	
+	_load_channels(s, conf, ch, index, mux);
+	
+	/* Channels can't be added, removed or change mode while running */
+	for(c = 0; c < 32; c++)
+	{
+		if(ch[c].mode != s->dsr.channels[c].mode || mux[c] != s->from_mux[c])
+		{
+			fprintf(stderr, "Warning: The channel layout has changed, restart to apply it\n");
+			free(conf);
+			return(-1);
+		}
+	}
+	
+	for(changes = 0, c = 0; c < 32; c++)
+	{
+		if(ch[c].mode == 4) continue;
+		
+		if(ch[c].type != s->dsr.channels[c].type ||
+		   ch[c].music != s->dsr.channels[c].music ||
+		   memcmp(ch[c].name, s->dsr.channels[c].name, 8) != 0)
+		{
+			_control_set(s, c, ch[c].type, ch[c].music, ch[c].name);
+			changes++;
+		}
+		
+		if(index[c] < 0) continue;
+		
+		/* Only reopen sources whose settings have changed */
+		if(_section_key(key[0], sizeof(key[0]), s->conf, s->openers[c].index, _channel_exclude) == 0 &&
+		   _section_key(key[1], sizeof(key[1]), conf, index[c], _channel_exclude) == 0 &&
+		   strcmp(key[0], key[1]) == 0 && !s->input[c])
+		{
+			s->openers[c].index = index[c];
+			continue;
+		}
+		
+		err = NULL;
+		
+		if(atomic_load_explicit(&s->openers[c].swap, memory_order_acquire))
+		{
+			err = "a previous change is still waiting";
+		}
+		else if(!(src = _open_src(s, conf, index[c], NULL)))
+		{
+			err = "failed to open the new source";
+		}
+		
+		if(err)
+		{
+			fprintf(stderr, "Warning: Channel %02d: %s, keeping the old source\n", (c >> 1) + 1, err);
+			continue;
+		}
+		
+		atomic_store_explicit(&s->openers[c].swap, src, memory_order_release);
+		s->openers[c].index = index[c];
+		
+		free(s->input[c]);
+		s->input[c] = NULL;
+		changes++;
+	}
+	
+	/* Every source now refers to the new configuration */
+	free(s->conf);
+	s->conf = conf;
+	
+	if(changes > 0)
+	{
+		atomic_store(&s->cache_stop, 1);
+	}
+	
+	if(s->verbose)
+	{
+		fprintf(stderr, "Configuration reloaded, %d change%s\n", changes, changes == 1 ? "" : "s");
+	}
+	
+	return(0);
+}
+
+static void _command(dsrtx_t *s, char *line, char *reply, size_t len)
+{
+	struct timespec t;
+	const char *err = NULL;
+	char *cmd, *v;
+	char name[8 * 4 + 1];
+	uint8_t ps[8];
+	double elapsed;
+	uint64_t sent;
+	int c, n, i, l;
+	
+	_reap_sources(s);
+	
+	cmd = _word(&line);
+	
+	if(!cmd)
+	{
+		snprintf(reply, len, "ERR No command\n");
+		return;
+	}
+	
+	if(strcasecmp(cmd, "help") == 0)
+	{
+		snprintf(reply, len,
+			"stats\n"
+			"channels\n"
+			"name <channel> <name>\n"
+			"type <channel> <program type>\n"
+			"music <channel> <0|1>\n"
+			"mute <channel>\n"
+			"unmute <channel>\n"
+			"restart <channel>\n"
+			"input <channel> <input>\n"
+			"reload\n"
+			"OK\n"
+		);
+		return;
+	}
+	
+	if(strcasecmp(cmd, "stats") == 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		elapsed = (t.tv_sec - s->started.tv_sec) + (t.tv_nsec - s->started.tv_nsec) * 1e-9;
+		sent = atomic_load(&s->sent);
+		
+		snprintf(reply, len, "blocks=%" PRIu64 " seconds=%.3f speed=%.3f cached=%d\nOK\n",
+			sent, elapsed,
+			elapsed > 0 ? sent * 64.0 / DSR_SAMPLE_RATE / elapsed : 0,
+			atomic_load(&s->cache_ready) == 1);
+		return;
+	}
+	
+	if(strcasecmp(cmd, "reload") == 0)
+	{
+		snprintf(reply, len, _reload(s) == 0 ? "OK\n" : "ERR Configuration not reloaded\n");
+		return;
+	}
 	
-	if(_abort > 0)
+	if(strcasecmp(cmd, "channels") == 0)
 	{
-		exit(-1);
+		for(l = 0, c = 0; c < 32; c++)
+		{
+			if(s->dsr.channels[c].mode != 1) continue;
+			
+			dsr_decode_ps(name, s->dsr.channels[c].name);
+			l += snprintf(reply + l, len - l, "%d%s \"%s\" type=%d music=%d%s\n",
+				(c >> 1) + 1,
+				!(c & 1) && s->dsr.channels[c + 1].mode == 2 ? "" : (c & 1 ? "b" : "a"),
+				name,
+				s->dsr.channels[c].type,
+				s->dsr.channels[c].music,
+				atomic_load(&s->mute) & (1U << c) ? " muted" : "");
+		}
+		
+		snprintf(reply + l, len - l, "OK\n");
+		return;
 	}
 	
-	_abort = 1;
-}
-
-static void print_usage(void)
-{
-	printf(
-		"\n"
-		"Usage: dsrtx [options]\n"
-		"\n"
-		"  -c, --config <file>      Load configuration from file.\n"
-		"  -v, --verbose            Enable verbose output.\n"
-		"\n"
-	);
-}
-
-static void *_open_src(conf_t conf, int i)
-{
-	src_t *src;
-	const char *v;
-	int r;
+	/* The remaining commands act on one channel */
+	v = _word(&line);
+	c = v ? _control_channel(s, v, &n) : -1;
 	
-	src = calloc(sizeof(src_t), 1);
-	if(!src)
+	if(c < 0)
 	{
-		perror("calloc");
-		return(NULL);
+		snprintf(reply, len, "ERR Unknown or unused channel\n");
+		return;
 	}
 	
-	v = conf_str(conf, "channel", i, "type", "rawaudio");
+	/* The rest of the line is the value */
+	line += strspn(line, " \t");
+	for(i = strlen(line); i > 0 && (line[i - 1] == ' ' || line[i - 1] == '\t'); i--);
+	line[i] = '\0';
 	
-	if(strcasecmp(v, "rawaudio") == 0)
+	if(strcasecmp(cmd, "name") == 0)
 	{
-		v = conf_str(conf, "channel", i, "input", NULL);
-		if(!v)
+		/* Quotes keep any leading or trailing spaces */
+		if(i >= 2 && line[0] == '"' && line[i - 1] == '"')
 		{
-			fprintf(stderr, "Warning: Missing input filename\n");
-			free(src);
-			return(NULL);
+			line[i - 1] = '\0';
+			line++;
 		}
 		
-		r = src_rawaudio_open(
-			src,
-			v,
-			conf_bool(conf, "channel", i, "exec", 0),
-			conf_bool(conf, "channel", i, "stereo", 1),
-			conf_bool(conf, "channel", i, "repeat", 0)
-		);
-		if(r != 0)
+		dsr_encode_ps(ps, line);
+		
+		for(i = c; i < c + n; i++)
 		{
-			fprintf(stderr, "Warning: Failed to open '%s'\n", v);
-			free(src);
-			return(NULL);
+			_control_set(s, i, s->dsr.channels[i].type, s->dsr.channels[i].music, ps);
 		}
 	}
-	else if(strcasecmp(v, "tone") == 0)
+	else if(strcasecmp(cmd, "type") == 0 ||
+	        strcasecmp(cmd, "secondary_type") == 0)
 	{
-		r = src_tone_open(
-			src,
-			conf_double(conf, "channel", i, "frequency", 0),
-			conf_double(conf, "channel", i, "level", 0)
-		);
-		if(r != 0)
+		/* The R half of a stereo channel carries the secondary type */
+		l = strcasecmp(cmd, "type") == 0 ? c : c + 1;
+		i = atoi(line);
+		
+		if(*line == '\0' || i < 0 || i > 15)
 		{
-			fprintf(stderr, "Warning: Failed to open tone source\n");
-			free(src);
-			return(NULL);
+			err = "Program type must be 0 to 15";
 		}
-	}
-#ifdef HAVE_FFMPEG
-	else if(strcasecmp(v, "ffmpeg") == 0)
-	{
-		v = conf_str(conf, "channel", i, "input", NULL);
-		if(!v)
+		else if(l == c + n)
 		{
-			fprintf(stderr, "Warning: Missing input filename/URL\n");
-			free(src);
-			return(NULL);
+			err = "Channel is not stereo";
+		}
+		else
+		{
+			_control_set(s, l, i, s->dsr.channels[l].music, s->dsr.channels[l].name);
 		}
+	}
+	else if(strcasecmp(cmd, "music") == 0)
+	{
+		_control_set(s, c, s->dsr.channels[c].type, atoi(line) ? 1 : 0, s->dsr.channels[c].name);
+	}
+	else if(strcasecmp(cmd, "mute") == 0)
+	{
+		atomic_fetch_or(&s->mute, (n == 2 ? 3U : 1U) << c);
+	}
+	else if(strcasecmp(cmd, "unmute") == 0)
+	{
+		atomic_fetch_and(&s->mute, ~((n == 2 ? 3U : 1U) << c));
+	}
+	else if(strcasecmp(cmd, "restart") == 0)
+	{
+		/* Without sharing, so it really is reopened */
+		err = _control_source(s, c, s->input[c] ? s->input[c] : conf_str(s->conf, "channel", s->openers[c].index, "input", ""));
+	}
+	else if(strcasecmp(cmd, "input") == 0)
+	{
+		err = *line ? _control_source(s, c, line) : "Missing input";
 		
-		r = src_ffmpeg_open(src, v);
-		if(r != 0)
+		if(!err)
 		{
-			fprintf(stderr, "Warning: Failed to open '%s'\n", v);
-			free(src);
-			return(NULL);
+			free(s->input[c]);
+			s->input[c] = strdup(line);
 		}
-
 	}
-#endif
 	else
 	{
-		fprintf(stderr, "Warning: Unrecognised input type '%s'\n", v);
-		free(src);
-		return(NULL);
+		err = "Unknown command";
+	}
+	
+	if(err)
+	{
+		snprintf(reply, len, "ERR %s\n", err);
+		return;
 	}
 	
-	return(src);
+	/* The cached output no longer matches */
+	atomic_store(&s->cache_stop, 1);
+	
+	snprintf(reply, len, "OK\n");
 }
 
-const int _load_config(dsrtx_t *s, const char *filename)
+static void _control(void *arg, char *line, char *reply, size_t len)
 {
-	conf_t conf;
-	const char *v;
-	int i;
-	int c;
-	
-	/* Load configuration */
-	conf = conf_loadfile(filename);
-	if(!conf) return(-1);
-	
-	/* Load configuration for output */
-	s->output_type = strdup(conf_str(conf, "output", -1, "type", "hackrf"));
-	s->output = strdup(conf_str(conf, "output", -1, "output", ""));
+	dsrtx_t *s = arg;
 	
-	s->data_type = -1;
-	v = conf_str(conf, "output", -1, "data_type", "");
-	if(strcmp(v, "uint8") == 0)       s->data_type = RF_UINT8;
-	else if(strcmp(v, "int8") == 0)   s->data_type = RF_INT8;
-	else if(strcmp(v, "uint16") == 0) s->data_type = RF_UINT16;
-	else if(strcmp(v, "int16") == 0)  s->data_type = RF_INT16;
-	else if(strcmp(v, "int32") == 0)  s->data_type = RF_INT32;
-	else if(strcmp(v, "float") == 0)  s->data_type = RF_FLOAT;
-	else if(strcmp(v, "") == 0)       s->data_type = -1;
-	else
-	{
-		fprintf(stderr, "Error: Invalid data type '%s'.\n", v);
-		free(conf);
-		return(-1);
-	}
+	pthread_mutex_lock(&s->control_mutex);
+	_command(s, line, reply, len);
+	pthread_mutex_unlock(&s->control_mutex);
+}
+
+static void *_reload_thread(void *arg)
+{
+	dsrtx_t *s = arg;
+	struct timespec ts = { 1, 0 };
+	sigset_t set;
+	int sig;
 	
-	s->sample_rate = conf_int(conf, "output", -1, "sample_rate", DSR_SYMBOL_RATE * 2);
-	s->frequency = conf_double(conf, "output", -1, "frequency", 0),
-	s->gain = conf_int(conf, "output", -1, "gain", 0);
-	s->amp = conf_int(conf, "output", -1, "amp", 0);
-	s->antenna = conf_str(conf, "output", -1, "antenna", NULL);
-	s->live = conf_bool(conf, "output", -1, "live", 0);
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
 	
-	/* Load configuration for each channel */
-	for(i = 0; conf_section_exists(conf, "channel", i); i++)
+	while(!atomic_load(&s->reload_quit))
 	{
-		c = conf_int(conf, "channel", i, "channel", 0);
-		if(c < 1 || c > 16)
-		{
-			/* Knowing the conf file line number would be handy here */
-			fprintf(stderr, "Warning: Invalid or missing channel number. Skipping\n");
-			continue;
-		}
-		c = (c - 1) * 2;
+		/* Wake up every second to close replaced sources, with
+		 * or without a control socket */
+		sig = sigtimedwait(&set, NULL, &ts);
+		if(atomic_load(&s->reload_quit)) break;
 		
-		v = conf_str(conf, "channel", i, "mode", "s");
+		pthread_mutex_lock(&s->control_mutex);
 		
-		if(strcasecmp(v, "s") == 0)
-		{
-			/* Stereo channel. Test if both L/R channels are free */
-			if(s->dsr.channels[c + 0].mode != 4 ||
-			   s->dsr.channels[c + 1].mode != 4)
-			{
-				fprintf(stderr, "Warning: Channel %02d/S is already allocated. Skipping\n", (c >> 1) + 1);
-				continue;
-			}
-			
-			/* Set the L channel parameters */
-			dsr_encode_ps(s->dsr.channels[c].name, conf_str(conf, "channel", i, "name", ""));
-			s->dsr.channels[c].type = conf_int(conf, "channel", i, "program_type", 0);
-			s->dsr.channels[c].music = conf_bool(conf, "channel", i, "music", 0) ? 1 : 0;
-			s->dsr.channels[c].mode = 1;
-			
-			/* Set the R channel parameters */
-			dsr_encode_ps(s->dsr.channels[c + 1].name, conf_str(conf, "channel", i, "name", ""));
-			s->dsr.channels[c + 1].type = conf_int(conf, "channel", i, "secondary_type", conf_int(conf, "channel", i, "program_type", 0));
-			s->dsr.channels[c + 1].music = 0;
-			s->dsr.channels[c + 1].mode = 2;
-		}
-		else if(strcasecmp(v, "a") == 0 ||
-		        strcasecmp(v, "b") == 0)
-		{
-			/* Mono A/B channel */
-			if(*v == 'b' || *v == 'B') c++;
-			
-			/* Test if this channel is free */
-			if(s->dsr.channels[c].mode != 4)
-			{
-				fprintf(stderr, "Warning: Channel %02d/%c is already allocated. Skipping\n", (c >> 1) + 1, c & 1 ? 'B' : 'A');
-				continue;
-			}
-			
-			/* Set the channel parameters */
-			dsr_encode_ps(s->dsr.channels[c].name, conf_str(conf, "channel", i, "name", ""));
-			s->dsr.channels[c].type = conf_int(conf, "channel", i, "program_type", 0);
-			s->dsr.channels[c].music = conf_bool(conf, "channel", i, "music", 0) ? 1 : 0;
-			s->dsr.channels[c].mode = 1;
-		}
-		else
+		if(sig == SIGHUP)
 		{
-			fprintf(stderr, "Warning: Unrecognised channel mode '%s'. Skipping\n", v);
-			continue;
+			fprintf(stderr, "Caught signal %d, reloading %s\n", sig, s->conffile);
+			_reload(s);
 		}
 		
-		/* Open the audio source */
-		s->dsr.channels[c].arg = _open_src(conf, i);
+		_reap_sources(s);
+		
+		pthread_mutex_unlock(&s->control_mutex);
 	}
 	
-	s->verbose = conf_bool(conf, NULL, -1, "verbose", s->verbose);
-	
-	free(conf);
-	
-	return(0);
+	return(NULL);
 }
 
 int main(int argc, char *argv[])
 {
 	dsrtx_t s;
 	const char *conffile = NULL;
+	uint64_t blocks = 0;
+	struct timespec t0, t1;
+	sigset_t set;
 	int c, option_index;
 	const struct option long_options[] = {
 		{ "version", no_argument,       0, 'v' },
 		{ "config",  required_argument, 0, 'c' },
 		{ "verbose", no_argument,       0, 'V' },
+		{ "start",   required_argument, 0, 'S' },
+		{ "end",     required_argument, 0, 'E' },
+		{ "blocks",  required_argument, 0, 'N' },
+		{ "duration", required_argument, 0, 'D' },
+		{ "eof",     no_argument,       0, 'F' },
 		{ 0, 0, 0, 0 }
 	};
-	uint8_t block[5120];
-	int16_t o2[40960 * 2 * 5];
-	int l;
-	int16_t audio[64 * 32];
 	
 #ifdef HAVE_FFMPEG
 	src_ffmpeg_init();
@@ -291,6 +1870,13 @@ int main(int argc, char *argv[])
 	
 	memset(&s, 0, sizeof(dsrtx_t));
 	dsr_init(&s.dsr);
+	pthread_mutex_init(&s.control_mutex, NULL);
+	
+	/* SIGHUP is only taken by the reload thread. Block it
+	 * here, before any other threads are started */
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
 	
 	opterr = 0;
 	while((c = getopt_long(argc, argv, "vc:V", long_options, &option_index)) != -1)
@@ -309,6 +1895,26 @@ int main(int argc, char *argv[])
 			s.verbose = 1;
 			break;
 		
+		case 'S': /* --start <block> */
+			s.start = strtoull(optarg, NULL, 10);
+			break;
+		
+		case 'E': /* --end <block> */
+			s.end = strtoull(optarg, NULL, 10);
+			break;
+		
+		case 'N': /* --blocks <n> */
+			blocks = strtoull(optarg, NULL, 10);
+			break;
+		
+		case 'D': /* --duration <seconds> */
+			blocks = llround(atof(optarg) * DSR_SAMPLE_RATE / 64);
+			break;
+		
+		case 'F': /* --eof */
+			s.stop_eof = 1;
+			break;
+		
 		case '?':
 			print_usage();
 			return(0);
@@ -321,6 +1927,19 @@ int main(int argc, char *argv[])
 		return(-1);
 	}
 	
+	if(blocks > 0)
+	{
+		s.end = s.start + blocks;
+	}
+	
+	if(s.end > 0 && s.end <= s.start)
+	{
+		fprintf(stderr, "The end block must be after the start\n");
+		return(-1);
+	}
+	
+	s.conffile = conffile;
+	
 	if(_load_config(&s, conffile) == -1)
 	{
 		/* Configuration error */
@@ -409,38 +2028,106 @@ int main(int argc, char *argv[])
 	/* Initalise the modulator */
 	rf_qpsk_init(&s.qpsk, s.sample_rate / DSR_SYMBOL_RATE, 0.8 * rf_scale(&s.rf));
 	
-	while(!_abort)
+	/* Encode a batch of blocks at once on several threads */
+	if(s.encode_threads > 1)
 	{
-		/* Update the audio block */
-		for(l = 0; l < 32; l++)
+		if(workers_init(&s.encode_workers, s.encode_threads) != 0)
 		{
-			if(s.dsr.channels[l & 30].mode == 1 &&
-			   s.dsr.channels[(l & 30) + 1].mode == 2)
-			{
-				src_read_stereo(s.dsr.channels[l].arg, &audio[l * 64], 1, &audio[(l + 1) * 64], 1, 64);
-				l++;
-			}
-			else if(s.dsr.channels[l].mode == 1)
-			{
-				src_read_mono(s.dsr.channels[l].arg, &audio[l * 64], 1, 64);
-			}
-			else
-			{
-				memset(&audio[l * 64], 0xFF, 64);
-			}
+			fprintf(stderr, "Warning: Failed to start the encoder threads\n");
+			s.encode_threads = 1;
+		}
+	}
+	
+	/* Split each block over several threads at high sample rates */
+	if(s.modulate_threads > 1)
+	{
+		if(workers_init(&s.modulate_workers, s.modulate_threads) != 0 ||
+		   rf_qpsk_workers(&s.qpsk, &s.modulate_workers, s.modulate_threads) != 0)
+		{
+			fprintf(stderr, "Warning: Failed to start the modulator threads\n");
+		}
+	}
+	
+	/* Offline outputs wait for every source, a live output
+	 * starts straight away and channels join as they open */
+	if(s.pool.blocking)
+	{
+		_wait_sources(&s);
+	}
+	
+	/* Build the transmit pipeline, each stage on its own thread */
+	if(_start_pipeline(&s) != 0)
+	{
+		fprintf(stderr, "Failed to start the pipeline\n");
+		return(-1);
+	}
+	
+	/* Fast forward to the first block */
+	if(s.start > 0)
+	{
+		if(s.verbose)
+		{
+			fprintf(stderr, "Seeking to block %" PRIu64 "\n", s.start);
 		}
 		
-		/* Encode the next audio block (2ms) */
-		dsr_encode(&s.dsr, block, audio);
-		
-		/* Modulate the block and transmit */
-		l = rf_qpsk_modulate(&s.qpsk, o2, block, 40960);
-		rf_write(&s.rf, o2, l);
+		_seek(&s);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	s.started = t0;
+	
+	/* Accept commands while running */
+	if(s.control_path)
+	{
+		if(control_open(&s.control, s.control_path, _control, &s) != 0)
+		{
+			fprintf(stderr, "Warning: Failed to open the control socket\n");
+		}
+	}
+	
+	if(pthread_create(&s.reload_thread, NULL, _reload_thread, &s) == 0)
+	{
+		s.reload_started = 1;
+	}
+	
+	pipeline_run(&s.pipeline, s.pipeline_depth > 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	
+	control_close(&s.control);
+	
+	if(s.reload_started)
+	{
+		atomic_store(&s.reload_quit, 1);
+		pthread_kill(s.reload_thread, SIGHUP);
+		pthread_join(s.reload_thread, NULL);
+	}
+	
+	/* Report the throughput of a render */
+	if(s.verbose || s.end > 0 || s.stop_eof)
+	{
+		_print_stats(&s, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9);
 	}
 	
+	_free_pipeline(&s);
+	
 	rf_close(&s.rf);
+	rf_qpsk_free(&s.qpsk);
+	_cache_free(&s);
+	
+	if(s.modulate_threads > 1)
+	{
+		workers_free(&s.modulate_workers);
+	}
+	
+	if(s.encode_threads > 1)
+	{
+		workers_free(&s.encode_workers);
+	}
 	
 	/* Close each source */
+	_wait_sources(&s);
+	_reap_sources(&s);
+	
 	for(c = 0; c < 32; c++)
 	{
 		if(s.dsr.channels[c].arg)
@@ -448,8 +2135,22 @@ int main(int argc, char *argv[])
 			src_close(s.dsr.channels[c].arg);
 			free(s.dsr.channels[c].arg);
 		}
+		
+		/* Any replacement that was never switched in */
+		if(s.openers[c].swap)
+		{
+			src_close(s.openers[c].swap);
+			free(s.openers[c].swap);
+		}
+		
+		free(s.input[c]);
 	}
 	
+	free(s.conf);
+	
+	src_pool_free(&s.pool);
+	src_shm_close(&s.mux);
+	
 #ifdef HAVE_FFMPEG
 	src_ffmpeg_deinit();
 #endif
@@ -0,0 +1,265 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "pipeline.h"
+
+static int _queue_init(pipeline_queue_t *q, int len)
+{
+	/* Never holds more than every job, plus the NULL that ends it */
+	for(q->len = 1; q->len < len + 1; q->len <<= 1);
+	
+	q->jobs = malloc(sizeof(void *) * q->len);
+	if(!q->jobs) return(-1);
+	
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	sem_init(&q->items, 0, 0);
+	
+	return(0);
+}
+
+static void _queue_free(pipeline_queue_t *q)
+{
+	if(!q->jobs) return;
+	
+	sem_destroy(&q->items);
+	free(q->jobs);
+	q->jobs = NULL;
+}
+
+static void _push(pipeline_queue_t *q, void *job)
+{
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	
+	q->jobs[head & (q->len - 1)] = job;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	sem_post(&q->items);
+}
+
+static void *_pop(pipeline_queue_t *q)
+{
+	unsigned int tail;
+	void *job;
+	
+	while(sem_wait(&q->items) != 0);
+	
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	job = q->jobs[tail & (q->len - 1)];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	
+	return(job);
+}
+
+static double _cpu_time(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	
+	return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static int _call(pipeline_stage_info_t *st, void *job)
+{
+	double t = _cpu_time();
+	int r;
+	
+	r = st->fn(st->arg, job);
+	st->cpu_time += _cpu_time() - t;
+	
+	return(r);
+}
+
+static void *_stage_thread(void *arg)
+{
+	pipeline_stage_info_t *st = arg;
+	pipeline_t *p = st->p;
+	pipeline_stage_info_t *next;
+	int i = st - p->stages;
+	int failed = 0;
+	void *job;
+	
+	/* The last stage hands its jobs back to the first */
+	next = &p->stages[(i + 1) % p->nstages];
+	
+	while(1)
+	{
+		job = _pop(&st->in);
+		
+		if(job == NULL)
+		{
+			/* End the following stages */
+			if(i < p->nstages - 1) _push(&next->in, NULL);
+			break;
+		}
+		
+		if(i == 0 && atomic_load(&p->quit))
+		{
+			/* Stopping, don't start any new jobs */
+			_push(&next->in, NULL);
+			break;
+		}
+		
+		if(!failed && _call(st, job) != 0)
+		{
+			failed = 1;
+			atomic_store(&p->quit, 1);
+			
+			if(i == 0)
+			{
+				_push(&next->in, NULL);
+				break;
+			}
+		}
+		
+		_push(&next->in, job);
+	}
+	
+	return(NULL);
+}
+
+int pipeline_init(pipeline_t *p, void **jobs, int njobs)
+{
+	memset(p, 0, sizeof(pipeline_t));
+	
+	p->jobs = jobs;
+	p->njobs = njobs;
+	atomic_init(&p->quit, 0);
+	
+	return(njobs > 0 ? 0 : -1);
+}
+
+int pipeline_add(pipeline_t *p, pipeline_stage_t fn, void *arg, int cpu)
+{
+	pipeline_stage_info_t *st;
+	
+	if(p->nstages == PIPELINE_MAX)
+	{
+		return(-1);
+	}
+	
+	st = &p->stages[p->nstages];
+	st->p = p;
+	st->fn = fn;
+	st->arg = arg;
+	st->cpu = cpu;
+	
+	if(_queue_init(&st->in, p->njobs) != 0)
+	{
+		return(-1);
+	}
+	
+	p->nstages++;
+	
+	return(0);
+}
+
+static int _run_single(pipeline_t *p)
+{
+	int i, j;
+	
+	/* Every stage in turn on this thread, one job at a time */
+	for(j = 0; !atomic_load(&p->quit); j = (j + 1) % p->njobs)
+	{
+		for(i = 0; i < p->nstages; i++)
+		{
+			if(_call(&p->stages[i], p->jobs[j]) != 0)
+			{
+				atomic_store(&p->quit, 1);
+				break;
+			}
+		}
+	}
+	
+	return(0);
+}
+
+int pipeline_run(pipeline_t *p, int threads)
+{
+	cpu_set_t cpus;
+	int i, r;
+	
+	if(p->nstages == 0)
+	{
+		return(-1);
+	}
+	
+	if(!threads)
+	{
+		return(_run_single(p));
+	}
+	
+	/* Every job starts out waiting for the first stage */
+	for(i = 0; i < p->njobs; i++)
+	{
+		_push(&p->stages[0].in, p->jobs[i]);
+	}
+	
+	for(i = 0; i < p->nstages; i++)
+	{
+		r = pthread_create(&p->stages[i].thread, NULL, _stage_thread, &p->stages[i]);
+		if(r != 0)
+		{
+			perror("pthread_create");
+			break;
+		}
+		
+		if(p->stages[i].cpu >= 0)
+		{
+			CPU_ZERO(&cpus);
+			CPU_SET(p->stages[i].cpu, &cpus);
+			
+			if(pthread_setaffinity_np(p->stages[i].thread, sizeof(cpus), &cpus) != 0)
+			{
+				fprintf(stderr, "Warning: Failed to set CPU affinity for stage %d\n", i);
+			}
+		}
+	}
+	
+	if(i < p->nstages)
+	{
+		/* Couldn't start every stage, stop the ones that did */
+		atomic_store(&p->quit, 1);
+		_push(&p->stages[0].in, NULL);
+	}
+	
+	for(r = 0; r < i; r++)
+	{
+		pthread_join(p->stages[r].thread, NULL);
+	}
+	
+	return(i < p->nstages ? -1 : 0);
+}
+
+void pipeline_free(pipeline_t *p)
+{
+	int i;
+	
+	for(i = 0; i < p->nstages; i++)
+	{
+		_queue_free(&p->stages[i].in);
+	}
+	
+	memset(p, 0, sizeof(pipeline_t));
+}
+
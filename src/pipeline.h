@@ -0,0 +1,88 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* A chain of processing stages, each on its own thread. A fixed set of
+ * jobs (buffers) circulates through the stages in order, and back to the
+ * first once the last stage is done with them. The stages are connected
+ * by single producer, single consumer rings, so the rate is set by the
+ * slowest stage rather than the sum of all of them. Each ring takes no
+ * lock, but a stage with nothing to do sleeps on a semaphore until the
+ * stage before it posts the next job.
+ * 
+ * A stage returns non-zero to stop the pipeline. Jobs already in flight
+ * are passed through the remaining stages before pipeline_run() returns.
+ * With threads off, every stage runs in turn on the calling thread.
+*/
+
+#define PIPELINE_MAX 8
+
+typedef int (*pipeline_stage_t)(void *arg, void *job);
+
+typedef struct {
+	
+	/* Ring of job pointers, a NULL job ends the stage.
+	 * The semaphore counts the jobs waiting in it */
+	void **jobs;
+	unsigned int len;
+	atomic_uint head;
+	atomic_uint tail;
+	sem_t items;
+	
+} pipeline_queue_t;
+
+typedef struct {
+	
+	struct _pipeline_t *p;
+	
+	pipeline_stage_t fn;
+	void *arg;
+	int cpu;
+	
+	pthread_t thread;
+	pipeline_queue_t in;
+	
+	/* CPU time spent in this stage, in seconds */
+	double cpu_time;
+	
+} pipeline_stage_info_t;
+
+typedef struct _pipeline_t {
+	
+	pipeline_stage_info_t stages[PIPELINE_MAX];
+	int nstages;
+	
+	void **jobs;
+	int njobs;
+	
+	atomic_int quit;
+	
+} pipeline_t;
+
+extern int pipeline_init(pipeline_t *p, void **jobs, int njobs);
+extern int pipeline_add(pipeline_t *p, pipeline_stage_t fn, void *arg, int cpu);
+extern int pipeline_run(pipeline_t *p, int threads);
+extern void pipeline_free(pipeline_t *p);
+
+#endif
+
@@ -0,0 +1,246 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "resample.h"
+
+/* Size of the input buffer, in samples per channel */
+#define BUFFER 4096
+
+static double _sinc(double x)
+{
+	if(x == 0) return(1.0);
+	return(sin(M_PI * x) / (M_PI * x));
+}
+
+static double _blackman(double x)
+{
+	/* x is in the range -1 .. 1 */
+	if(x < -1 || x > 1) return(0);
+	return(0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2.0 * M_PI * x));
+}
+
+void resample_free(resample_t *s)
+{
+	int i;
+	
+	for(i = 0; i < RESAMPLE_CHANNELS; i++)
+	{
+		free(s->buf[i]);
+	}
+	
+	free(s->filter);
+	memset(s, 0, sizeof(resample_t));
+}
+
+int resample_init(resample_t *s, int channels, double ratio)
+{
+	double fc, t, r, sum;
+	float *h;
+	int i, x;
+	
+	memset(s, 0, sizeof(resample_t));
+	
+	if(channels < 1 || channels > RESAMPLE_CHANNELS || ratio <= 0)
+	{
+		return(-1);
+	}
+	
+	s->channels = channels;
+	s->ratio = ratio;
+	
+	/* Filter cut-off, relative to the input Nyquist frequency. Leave
+	 * a little room for the transition band when downsampling */
+	fc = (ratio > 1.0 ? 0.95 / ratio : 0.95);
+	
+	/* Filter length grows as the cut-off drops. Rounded up to a
+	 * multiple of 8 to keep the dot products vector friendly */
+	s->taps = ((int) ceil(16.0 / fc) + 7) & ~7;
+	
+	s->filter = malloc(sizeof(float) * s->taps * (RESAMPLE_PHASES + 1));
+	if(!s->filter)
+	{
+		resample_free(s);
+		return(-1);
+	}
+	
+	/* Generate the windowed sinc for each phase */
+	for(i = 0; i <= RESAMPLE_PHASES; i++)
+	{
+		h = &s->filter[i * s->taps];
+		
+		for(sum = 0, x = 0; x < s->taps; x++)
+		{
+			t = x - (s->taps / 2 - 1) - (double) i / RESAMPLE_PHASES;
+			r = fc * _sinc(fc * t) * _blackman(t / (s->taps / 2));
+			h[x] = r;
+			sum += r;
+		}
+		
+		/* Normalise each phase for unity gain */
+		for(x = 0; x < s->taps; x++)
+		{
+			h[x] /= sum;
+		}
+	}
+	
+	s->len = BUFFER + s->taps;
+	
+	for(i = 0; i < channels; i++)
+	{
+		s->buf[i] = calloc(s->len, sizeof(float));
+		if(!s->buf[i])
+		{
+			resample_free(s);
+			return(-1);
+		}
+	}
+	
+	/* Prime the history with silence */
+	s->n = s->taps - 1;
+	s->pos = s->taps / 2 - 1;
+	
+	return(0);
+}
+
+void resample_ratio(resample_t *s, double ratio)
+{
+	s->ratio = ratio;
+}
+
+int resample_write(resample_t *s, int16_t *audio[], const int audio_step[], int samples)
+{
+	const int16_t *src;
+	float *dst;
+	int c, i;
+	
+	if(samples > s->len - s->n)
+	{
+		samples = s->len - s->n;
+	}
+	
+	for(c = 0; c < s->channels; c++)
+	{
+		src = audio[c];
+		dst = &s->buf[c][s->n];
+		
+		if(audio_step[c] == 1)
+		{
+			for(i = 0; i < samples; i++)
+			{
+				dst[i] = src[i];
+			}
+		}
+		else
+		{
+			for(i = 0; i < samples; i++, src += audio_step[c])
+			{
+				dst[i] = *src;
+			}
+		}
+	}
+	
+	s->n += samples;
+	
+	return(samples);
+}
+
+int resample_read(resample_t *s, int16_t *audio[], const int audio_step[], int samples)
+{
+	const float *h0, *h1, *x;
+	float a0[8], a1[8];
+	float y0, y1, f;
+	int16_t *dst[RESAMPLE_CHANNELS];
+	int c, i, j, k, p, n;
+	double ph;
+	
+	for(c = 0; c < s->channels; c++)
+	{
+		dst[c] = audio[c];
+	}
+	
+	for(n = 0; n < samples; n++)
+	{
+		/* Stop when the filter would run past the buffered input */
+		i = (int) s->pos;
+		if(i + s->taps / 2 >= s->n) break;
+		
+		/* Select the two nearest filter phases */
+		ph = (s->pos - i) * RESAMPLE_PHASES;
+		p = (int) ph;
+		f = ph - p;
+		
+		h0 = &s->filter[p * s->taps];
+		h1 = h0 + s->taps;
+		
+		for(c = 0; c < s->channels; c++)
+		{
+			x = &s->buf[c][i - (s->taps / 2 - 1)];
+			
+			/* Accumulate in 8 lanes so the compiler can vectorise */
+			memset(a0, 0, sizeof(a0));
+			memset(a1, 0, sizeof(a1));
+			
+			for(k = 0; k < s->taps; k += 8)
+			{
+				for(j = 0; j < 8; j++)
+				{
+					a0[j] += x[k + j] * h0[k + j];
+					a1[j] += x[k + j] * h1[k + j];
+				}
+			}
+			
+			for(y0 = y1 = 0, j = 0; j < 8; j++)
+			{
+				y0 += a0[j];
+				y1 += a1[j];
+			}
+			
+			y0 += (y1 - y0) * f;
+			
+			if(y0 > INT16_MAX) y0 = INT16_MAX;
+			else if(y0 < INT16_MIN) y0 = INT16_MIN;
+			
+			*dst[c] = lrintf(y0);
+			dst[c] += audio_step[c];
+		}
+		
+		s->pos += s->ratio;
+	}
+	
+	/* Drop history that is no longer needed */
+	i = (int) s->pos - (s->taps / 2 - 1);
+	
+	if(i > 0)
+	{
+		if(i > s->n) i = s->n;
+		
+		for(c = 0; c < s->channels; c++)
+		{
+			memmove(s->buf[c], &s->buf[c][i], sizeof(float) * (s->n - i));
+		}
+		
+		s->n -= i;
+		s->pos -= i;
+	}
+	
+	return(n);
+}
+
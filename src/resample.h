@@ -0,0 +1,58 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#include <stdint.h>
+
+/* A streaming polyphase resampler for 16-bit audio. The ratio is the
+ * number of input samples consumed per output sample, and can be
+ * adjusted on the fly in steps of a fraction of a ppm. Filter phases
+ * are linearly interpolated between RESAMPLE_PHASES fixed steps.
+*/
+
+#define RESAMPLE_PHASES   256
+#define RESAMPLE_CHANNELS 2
+
+typedef struct {
+	
+	int channels;
+	int taps;
+	
+	/* Filter bank, (RESAMPLE_PHASES + 1) rows of taps */
+	float *filter;
+	
+	/* Input history, one buffer per channel */
+	float *buf[RESAMPLE_CHANNELS];
+	int len;
+	int n;
+	
+	/* Position of the next output sample within buf */
+	double pos;
+	double ratio;
+	
+} resample_t;
+
+extern int resample_init(resample_t *s, int channels, double ratio);
+extern void resample_free(resample_t *s);
+extern void resample_ratio(resample_t *s, double ratio);
+extern int resample_write(resample_t *s, int16_t *audio[], const int audio_step[], int samples);
+extern int resample_read(resample_t *s, int16_t *audio[], const int audio_step[], int samples);
+
+#endif
+
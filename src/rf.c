@@ -84,6 +84,40 @@ static double _rrc(double x, double b, double t)
 	return(r);
 }
 
+/* One segment of a block being modulated in parallel */
+typedef struct _rf_qpsk_seg_t {
+	
+	/* Modulator state for this segment, sharing the taps */
+	rf_qpsk_t st;
+	
+	/* Output for the history symbols, discarded */
+	int16_t *hist;
+	
+	/* Range of symbols to output */
+	int start;
+	int end;
+	
+	const uint8_t *src;
+	int16_t *dst;
+	
+} _rf_qpsk_seg_t;
+
+static void _free_segments(rf_qpsk_t *s)
+{
+	int i;
+	
+	for(i = 0; i < s->nseg; i++)
+	{
+		free(s->seg[i].st.win);
+		free(s->seg[i].hist);
+	}
+	
+	free(s->seg);
+	s->seg = NULL;
+	s->nseg = 0;
+	s->workers = NULL;
+}
+
 void rf_qpsk_free(rf_qpsk_t *s)
 {
 	int i;
@@ -92,6 +126,7 @@ void rf_qpsk_free(rf_qpsk_t *s)
 		free(s->taps[i]);
 	}
 	free(s->win);
+	_free_segments(s);
 }
 
 int rf_qpsk_init(rf_qpsk_t *s, int interpolation, double level)
@@ -140,7 +175,7 @@ int rf_qpsk_init(rf_qpsk_t *s, int interpolation, double level)
 	return(0);
 }
 
-int rf_qpsk_modulate(rf_qpsk_t *s, int16_t *dst, const uint8_t *src, int bits)
+static int _modulate(rf_qpsk_t *s, int16_t *dst, const uint8_t *src, int bits)
 {
 	const uint8_t map[4] = { 0, 3, 1, 2 };
 	const int16_t *taps;
@@ -184,3 +219,176 @@ int rf_qpsk_modulate(rf_qpsk_t *s, int16_t *dst, const uint8_t *src, int bits)
 	return(bits / 2 * s->interpolation);
 }
 
+static int _history(rf_qpsk_t *s)
+{
+	/* The number of earlier symbols that still overlap the output
+	 * of a symbol, rounded up to a whole byte of input */
+	return(((s->ntaps + s->interpolation - 1) / s->interpolation + 3) & ~3);
+}
+
+int rf_qpsk_workers(rf_qpsk_t *s, workers_t *workers, int segments)
+{
+	_rf_qpsk_seg_t *seg;
+	int i;
+	
+	_free_segments(s);
+	
+	if(!workers || segments <= 1)
+	{
+		return(0);
+	}
+	
+	s->seg = calloc(segments, sizeof(_rf_qpsk_seg_t));
+	if(!s->seg) return(-1);
+	
+	s->nseg = segments;
+	
+	for(i = 0; i < segments; i++)
+	{
+		seg = &s->seg[i];
+		
+		seg->st = *s;
+		seg->st.win = calloc(sizeof(int16_t) * 2, s->ntaps);
+		seg->st.nseg = 0;
+		seg->st.seg = NULL;
+		seg->hist = malloc(sizeof(int16_t) * 2 * _history(s) * s->interpolation);
+		
+		if(!seg->st.win || !seg->hist)
+		{
+			_free_segments(s);
+			return(-1);
+		}
+	}
+	
+	s->workers = workers;
+	
+	return(0);
+}
+
+static void _modulate_segment(void *arg, int index)
+{
+	rf_qpsk_t *s = arg;
+	_rf_qpsk_seg_t *seg = &s->seg[index];
+	int h = _history(s);
+	
+	if(index == 0)
+	{
+		/* The first segment carries on from the previous call */
+		_modulate(s, seg->dst, seg->src, (seg->end - seg->start) * 2);
+		return;
+	}
+	
+	/* Rebuild the window from the symbols before this segment.
+	 * The sums wrap the same way in any order, so the result is
+	 * identical to modulating the whole block in one go */
+	memset(seg->st.win, 0, sizeof(int16_t) * 2 * s->ntaps);
+	seg->st.winx = 0;
+	
+	_modulate(&seg->st, seg->hist, &seg->src[(seg->start - h) / 4], h * 2);
+	_modulate(&seg->st, &seg->dst[seg->start * s->interpolation * 2], &seg->src[seg->start / 4], (seg->end - seg->start) * 2);
+}
+
+int rf_qpsk_modulate(rf_qpsk_t *s, int16_t *dst, const uint8_t *src, int bits)
+{
+	const uint8_t map[4] = { 0, 3, 1, 2 };
+	_rf_qpsk_seg_t *last;
+	int symbols = bits / 2;
+	int h, i, x, n, sym, winx;
+	
+	h = _history(s);
+	n = s->nseg > 1 ? (symbols / s->nseg) & ~3 : 0;
+	
+	if(n < h * 2 || (bits & 7))
+	{
+		/* Not worth splitting */
+		return(_modulate(s, dst, src, bits));
+	}
+	
+	/* Find the differential state at the start of each segment's
+	 * history. This is cheap next to the filtering */
+	sym = s->sym;
+	
+	for(x = 0, i = 0; i < s->nseg; i++)
+	{
+		s->seg[i].start = i * n;
+		s->seg[i].end = (i == s->nseg - 1 ? symbols : (i + 1) * n);
+		s->seg[i].src = src;
+		s->seg[i].dst = dst;
+		
+		if(i == 0) continue;
+		
+		for(; x < s->seg[i].start - h; x++)
+		{
+			sym += map[(src[x >> 2] >> (6 - (x & 3) * 2)) & 0x03];
+		}
+		
+		s->seg[i].st.sym = sym & 3;
+	}
+	
+	winx = (s->winx + symbols * s->interpolation) % s->ntaps;
+	
+	workers_run(s->workers, _modulate_segment, s, s->nseg);
+	
+	/* Continue from the end of the last segment */
+	last = &s->seg[s->nseg - 1];
+	
+	for(i = 0; i < s->ntaps; i++)
+	{
+		x = (winx + i) % s->ntaps;
+		n = (last->st.winx + i) % s->ntaps;
+		s->win[x * 2 + 0] = last->st.win[n * 2 + 0];
+		s->win[x * 2 + 1] = last->st.win[n * 2 + 1];
+	}
+	
+	s->winx = winx;
+	s->sym = last->st.sym;
+	
+	return(symbols * s->interpolation);
+}
+
+int rf_qpsk_skip(rf_qpsk_t *s, const uint8_t *src, int bits)
+{
+	const uint8_t map[4] = { 0, 3, 1, 2 };
+	int symbols = bits / 2;
+	int h = _history(s);
+	int16_t *dst;
+	int x;
+	
+	/* Only the last few symbols are still in the window, the
+	 * rest just need their effect on the differential state */
+	x = (symbols >= h * 2 && !(bits & 7) ? (symbols - h) & ~3 : 0);
+	
+	if(x > 0)
+	{
+		for(bits = 0; bits < x; bits++)
+		{
+			s->sym += map[(src[bits >> 2] >> (6 - (bits & 3) * 2)) & 0x03];
+		}
+		
+		s->sym &= 3;
+		memset(s->win, 0, sizeof(int16_t) * 2 * s->ntaps);
+	}
+	
+	dst = malloc(sizeof(int16_t) * 2 * (symbols - x) * s->interpolation);
+	if(!dst) return(-1);
+	
+	_modulate(s, dst, &src[x / 4], (symbols - x) * 2);
+	free(dst);
+	
+	return(0);
+}
+
+int rf_qpsk_phase(const uint8_t *src, int bits)
+{
+	const uint8_t map[4] = { 0, 3, 1, 2 };
+	int x, sym;
+	
+	/* The total phase step over a run of symbols, in quarter turns */
+	for(sym = x = 0; x < bits; x += 2)
+	{
+		sym += map[(src[x >> 3] >> (6 - (x & 0x07))) & 0x03];
+	}
+	
+	return(sym & 3);
+}
+
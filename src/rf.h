@@ -20,6 +20,8 @@
 #ifndef _RF_H
 #define _RF_H
 
+#include "workers.h"
+
 /* File output types */
 #define RF_UINT8  0
 #define RF_INT8   1
@@ -60,10 +62,18 @@ typedef struct {
 	/* Differential state */
 	int sym;
 	
+	/* Optional parallel modulation */
+	workers_t *workers;
+	int nseg;
+	struct _rf_qpsk_seg_t *seg;
+	
 } rf_qpsk_t;
 
 extern void rf_qpsk_free(rf_qpsk_t *s);
 extern int rf_qpsk_init(rf_qpsk_t *s, int interpolation, double level);
+extern int rf_qpsk_workers(rf_qpsk_t *s, workers_t *workers, int segments);
+extern int rf_qpsk_phase(const uint8_t *src, int bits);
+extern int rf_qpsk_skip(rf_qpsk_t *s, const uint8_t *src, int bits);
 extern int rf_qpsk_modulate(rf_qpsk_t *s, int16_t *dst, const uint8_t *src, int bits);
 
 #include "rf_file.h"
@@ -212,7 +212,10 @@ int rf_file_open(rf_t *s, const char *filename, int type, int live)
 	/* Double the size for complex types */
 	rf->data_size *= 2;
 	
-	rf->samples = 1024;
+	/* Convert in large chunks, so each batch of blocks
+	 * reaches the file in only a few writes */
+	rf->samples = 65536;
+	setvbuf(rf->f, NULL, _IOFBF, rf->data_size * rf->samples);
 	
 	/* Allocate the memory, unless the output is int16 */
 	if(rf->type != RF_INT16)
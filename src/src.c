@@ -16,52 +16,71 @@
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stddef.h>
+#include <string.h>
 #include "src.h"
 
-int src_read_mono(src_t *s, int16_t *dst, int step, int samples)
+static void _copy(int16_t *restrict dst, int dst_step, const int16_t *restrict src, int src_step, int n)
 {
 	int i;
 	
-	if(!s || s->audio_len < 0)
+	if(dst_step == 1 && src_step == 1)
 	{
-		/* EOF */
-		return(0);
+		memcpy(dst, src, sizeof(int16_t) * n);
+	}
+	else if(dst_step == 1 && src_step == 2)
+	{
+		/* Deinterleave. Kept simple so the compiler can vectorise it */
+		for(i = 0; i < n; i++)
+		{
+			dst[i] = src[i * 2];
+		}
 	}
+	else
+	{
+		for(i = 0; i < n; i++)
+		{
+			dst[i * dst_step] = src[i * src_step];
+		}
+	}
+}
+
+static void _mix(int16_t *restrict dst, int dst_step, const int16_t *a, int a_step, const int16_t *b, int b_step, int n)
+{
+	int i;
 	
-	for(i = 0; i < samples;)
+	if(a == b && a_step == b_step)
 	{
-		/* Fetch a new buffer if no audio is available */
-		if(s->audio_len == 0)
+		/* The source is already mono */
+		_copy(dst, dst_step, a, a_step, n);
+	}
+	else if(dst_step == 1 && a_step == 1 && b_step == 1)
+	{
+		/* Planar stereo */
+		for(i = 0; i < n; i++)
 		{
-			if(!s->read) s->audio_len = -1;
-			else s->audio_len = s->read(s->private, s->audio, s->audio_step);
+			dst[i] = (a[i] + b[i]) / 2;
 		}
-		
-		/* Test for EOF */
-		if(s->audio_len < 0)
+	}
+	else if(dst_step == 1 && a_step == 2 && b_step == 2)
+	{
+		/* Interleaved stereo */
+		for(i = 0; i < n; i++)
 		{
-			s->eof = -1;
-			break;
+			dst[i] = (a[i * 2] + b[i * 2]) / 2;
 		}
-		
-		/* Copy audio */
-		for(; s->audio_len > 0 && i < samples; i++)
+	}
+	else
+	{
+		for(i = 0; i < n; i++)
 		{
-			*dst = (*s->audio[0] + *s->audio[1]) / 2;
-			dst += step;
-			
-			s->audio[0] += s->audio_step[0];
-			s->audio[1] += s->audio_step[1];
-			s->audio_len--;
+			dst[i * dst_step] = (a[i * a_step] + b[i * b_step]) / 2;
 		}
 	}
-	
-	return(i);
 }
 
-int src_read_stereo(src_t *s, int16_t *dst_l, int step_l, int16_t *dst_r, int step_r, int samples)
+static int _read(src_t *s, int16_t *dst_l, int step_l, int16_t *dst_r, int step_r, int samples)
 {
-	int i;
+	int i, n;
 	
 	if(!s || s->audio_len < 0)
 	{
@@ -69,13 +88,16 @@ int src_read_stereo(src_t *s, int16_t *dst_l, int step_l, int16_t *dst_r, int st
 		return(0);
 	}
 	
-	for(i = 0; i < samples;)
+	for(i = 0; i < samples; i += n)
 	{
 		/* Fetch a new buffer if no audio is available */
 		if(s->audio_len == 0)
 		{
 			if(!s->read) s->audio_len = -1;
 			else s->audio_len = s->read(s->private, s->audio, s->audio_step);
+			
+			/* Nothing ready yet, return what there is */
+			if(s->audio_len == 0) break;
 		}
 		
 		/* Test for EOF */
@@ -85,24 +107,44 @@ int src_read_stereo(src_t *s, int16_t *dst_l, int step_l, int16_t *dst_r, int st
 			break;
 		}
 		
-		/* Copy audio */
-		for(; s->audio_len > 0 && i < samples; i++)
+		/* Copy as much audio as is available in one go */
+		n = samples - i;
+		if(n > s->audio_len) n = s->audio_len;
+		
+		if(dst_r)
 		{
-			*dst_l = *s->audio[0];
-			dst_l += step_l;
-			s->audio[0] += s->audio_step[0];
-			
-			*dst_r = *s->audio[1];
-			dst_r += step_r;
-			s->audio[1] += s->audio_step[1];
-			
-			s->audio_len--;
+			_copy(&dst_l[i * step_l], step_l, s->audio[0], s->audio_step[0], n);
+			_copy(&dst_r[i * step_r], step_r, s->audio[1], s->audio_step[1], n);
 		}
+		else
+		{
+			/* No right channel, downmix to mono */
+			_mix(&dst_l[i * step_l], step_l, s->audio[0], s->audio_step[0], s->audio[1], s->audio_step[1], n);
+		}
+		
+		s->audio[0] += s->audio_step[0] * n;
+		s->audio[1] += s->audio_step[1] * n;
+		s->audio_len -= n;
 	}
 	
 	return(i);
 }
 
+int src_read_block(src_t *s, int16_t *dst_l, int16_t *dst_r, int samples)
+{
+	return(_read(s, dst_l, 1, dst_r, 1, samples));
+}
+
+int src_read_mono(src_t *s, int16_t *dst, int step, int samples)
+{
+	return(_read(s, dst, step, NULL, 0, samples));
+}
+
+int src_read_stereo(src_t *s, int16_t *dst_l, int step_l, int16_t *dst_r, int step_r, int samples)
+{
+	return(_read(s, dst_l, step_l, dst_r, step_r, samples));
+}
+
 int src_eof(src_t *s)
 {
 	if(!s) return(-1); /* EOF */
@@ -22,6 +22,8 @@
 
 #define SRC_SAMPLE_RATE 32000
 
+/* A read returns the number of samples available, -1 at EOF, or 0 if
+ * a live source has nothing ready yet and should be tried again later */
 typedef int (*src_read_t)(void *private, int16_t *audio[2], int audio_step[2]);
 typedef int (*src_close_t)(void *private);
 
@@ -36,8 +38,17 @@ typedef struct {
 	int audio_len;
 	int eof;
 	
+	/* Length in samples after which the audio repeats exactly,
+	 * or 0 if it doesn't */
+	long period;
+	
 } src_t;
 
+/* Read a block of audio into separate L and R buffers. If dst_r is NULL
+ * the audio is downmixed to mono into dst_l. Returns the number of
+ * samples read, which is less than requested at EOF or when the source
+ * has nothing ready yet. src_eof() tells the two apart */
+extern int src_read_block(src_t *s, int16_t *dst_l, int16_t *dst_r, int samples);
 extern int src_read_stereo(src_t *s, int16_t *dst_l, int step_l, int16_t *dst_r, int step_r, int samples);
 extern int src_read_mono(src_t *s, int16_t *dst, int step, int samples);
 extern int src_eof(src_t *s);
@@ -45,6 +56,11 @@ extern int src_close(src_t *s);
 
 #include "src_tone.h"
 #include "src_rawaudio.h"
+#include "src_prefetch.h"
+#include "src_shared.h"
+#include "src_rtp.h"
+#include "src_shm.h"
+#include "src_playlist.h"
 #ifdef HAVE_FFMPEG
 #include "src_ffmpeg.h"
 #endif
@@ -21,6 +21,9 @@
 #include <libswresample/swresample.h>
 #include <libavutil/opt.h>
 #include <libavutil/time.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include "src.h"
 
 typedef struct {
@@ -54,6 +57,7 @@ static void _print_ffmpeg_error(int r)
 
 static int _src_ffmpeg_read(src_ffmpeg_t *src, int16_t *audio[2], int audio_step[2])
 {
+	uint8_t *planes[2];
 	AVPacket pkt;
 	int r;
 	
@@ -81,9 +85,12 @@ static int _src_ffmpeg_read(src_ffmpeg_t *src, int16_t *audio[2], int audio_step
 	}
 	
 	/* We have received a frame! Resample and return */
+	planes[0] = (uint8_t *) (src->audio + 0);
+	planes[1] = (uint8_t *) (src->audio + src->audio_len);
+	
 	r = swr_convert(
 		src->swr_ctx,
-		(uint8_t **) &src->audio,
+		planes,
 		src->audio_len,
 		(const uint8_t **) src->frame->data,
 		src->frame->nb_samples
@@ -91,9 +98,10 @@ static int _src_ffmpeg_read(src_ffmpeg_t *src, int16_t *audio[2], int audio_step
 	
 	av_frame_unref(src->frame);
 	
+	/* The resampler outputs planar audio, no need to deinterleave */
 	audio[0] = src->audio + 0;
-	audio[1] = src->audio + 1;
-	audio_step[0] = audio_step[1] = 2;
+	audio[1] = src->audio + src->audio_len;
+	audio_step[0] = audio_step[1] = 1;
 	
 	return(r);
 }
@@ -245,7 +253,7 @@ int src_ffmpeg_open(src_t *s, const char *input_url)
 #endif
 	
 	av_opt_set_int(src->swr_ctx, "out_sample_rate",       SRC_SAMPLE_RATE, 0);
-	av_opt_set_sample_fmt(src->swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+	av_opt_set_sample_fmt(src->swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_S16P, 0);
 	
 	if(swr_init(src->swr_ctx) < 0)
 	{
@@ -276,6 +284,687 @@ int src_ffmpeg_open(src_t *s, const char *input_url)
 	return(0);
 }
 
+/* Multi-channel input. A demuxer is opened once per input URL and shared
+ * by every channel that reads from it. Each selected stream is decoded
+ * and resampled once, keeping all of its channels, into a planar ring.
+ * Channels then pick one or two planes from the ring with their own
+ * read position. Demuxing holds off while the slowest reader of any
+ * stream would otherwise be overwritten.
+ * 
+ * The input is read without holding the lock, as it may block on the
+ * network. Readers that catch up with it meanwhile return no audio yet,
+ * rather than holding a prefetch worker while they wait. */
+
+/* Samples returned by a read at a time (20ms) */
+#define CHUNK (SRC_SAMPLE_RATE / 50)
+
+/* How long demuxing holds off for a stalled reader before skipping it ahead */
+#define STALL_TIMEOUT 1
+
+typedef struct _src_ffmpeg_map_t src_ffmpeg_map_t;
+
+typedef struct {
+	
+	AVCodecContext *codec_ctx;
+	struct SwrContext *swr_ctx;
+	int channels;
+	
+	/* Resampler output, copied into the ring */
+	int16_t *out;
+	uint8_t **planes;
+	int out_len;
+	
+	/* Planar ring, one plane per channel */
+	int16_t *ring;
+	unsigned int len;
+	uint64_t head;
+	
+	/* Channels reading from this stream */
+	src_ffmpeg_map_t *readers;
+	
+} _ffmpeg_stream_t;
+
+typedef struct _ffmpeg_demux_t {
+	
+	struct _ffmpeg_demux_t *next;
+	char *url;
+	int refs;
+	
+	/* Held while decoding. Signalled when a read from the input ends */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int demuxing;
+	double full_since;
+	
+	AVFormatContext *format_ctx;
+	AVFrame *frame;
+	int eof;
+	
+	/* Decoders for the selected streams, by stream index. Only the
+	 * streams found when the input was opened can be selected */
+	_ffmpeg_stream_t **streams;
+	int nb_streams;
+	
+} _ffmpeg_demux_t;
+
+struct _src_ffmpeg_map_t {
+	
+	src_ffmpeg_map_t *next;
+	_ffmpeg_demux_t *dm;
+	_ffmpeg_stream_t *st;
+	int map[2];
+	uint64_t pos;
+	
+	/* The run last returned, copied out of the ring */
+	int16_t buf[2][CHUNK];
+	
+};
+
+/* Registry of open demuxers */
+static pthread_mutex_t _demux_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _ffmpeg_demux_t *_demuxers = NULL;
+
+static double _now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void _stream_free(_ffmpeg_stream_t *st)
+{
+	if(!st) return;
+	
+	avcodec_free_context(&st->codec_ctx);
+	swr_free(&st->swr_ctx);
+	free(st->planes);
+	free(st->out);
+	free(st->ring);
+	free(st);
+}
+
+static void _demux_free(_ffmpeg_demux_t *dm)
+{
+	int i;
+	
+	if(dm->streams)
+	{
+		for(i = 0; i < dm->nb_streams; i++)
+		{
+			_stream_free(dm->streams[i]);
+		}
+		
+		free(dm->streams);
+	}
+	
+	av_frame_free(&dm->frame);
+	avformat_close_input(&dm->format_ctx);
+	pthread_cond_destroy(&dm->cond);
+	pthread_mutex_destroy(&dm->mutex);
+	free(dm->url);
+	free(dm);
+}
+
+static void _stream_convert(_ffmpeg_stream_t *st, AVFrame *frame)
+{
+	unsigned int x, n;
+	int c, r;
+	
+	/* Grow the resampler output buffer if needed */
+	r = swr_get_out_samples(st->swr_ctx, frame->nb_samples);
+	
+	if(r > st->out_len)
+	{
+		free(st->out);
+		st->out_len = r;
+		st->out = malloc(sizeof(int16_t) * st->channels * st->out_len);
+		if(!st->out)
+		{
+			st->out_len = 0;
+			return;
+		}
+	}
+	
+	for(c = 0; c < st->channels; c++)
+	{
+		st->planes[c] = (uint8_t *) &st->out[c * st->out_len];
+	}
+	
+	r = swr_convert(
+		st->swr_ctx,
+		st->planes,
+		st->out_len,
+		(const uint8_t **) frame->data,
+		frame->nb_samples
+	);
+	
+	/* Copy into the ring, wrapping at the end */
+	while(r > 0)
+	{
+		x = st->head & (st->len - 1);
+		n = st->len - x;
+		if(n > r) n = r;
+		
+		for(c = 0; c < st->channels; c++)
+		{
+			memcpy(
+				&st->ring[c * st->len + x],
+				(int16_t *) st->planes[c],
+				sizeof(int16_t) * n
+			);
+			
+			st->planes[c] += sizeof(int16_t) * n;
+		}
+		
+		st->head += n;
+		r -= n;
+	}
+}
+
+static uint64_t _stream_tail(_ffmpeg_stream_t *st)
+{
+	src_ffmpeg_map_t *src;
+	uint64_t tail = st->head;
+	
+	/* The position of the slowest reader */
+	for(src = st->readers; src; src = src->next)
+	{
+		if(src->pos < tail) tail = src->pos;
+	}
+	
+	return(tail);
+}
+
+static _ffmpeg_stream_t *_demux_full(_ffmpeg_demux_t *dm)
+{
+	_ffmpeg_stream_t *st;
+	int i;
+	
+	/* Find any stream without room for the next packet. Half
+	 * the ring is kept free, much more than one packet decodes to */
+	for(i = 0; i < dm->nb_streams; i++)
+	{
+		st = dm->streams[i];
+		
+		if(st && st->head - _stream_tail(st) > st->len / 2)
+		{
+			return(st);
+		}
+	}
+	
+	return(NULL);
+}
+
+static void _demux_stalled(_ffmpeg_demux_t *dm, _ffmpeg_stream_t *st)
+{
+	src_ffmpeg_map_t *src;
+	
+	/* Give the slowest readers a while to move on */
+	if(dm->full_since == 0)
+	{
+		dm->full_since = _now();
+		return;
+	}
+	
+	if(_now() - dm->full_since < STALL_TIMEOUT)
+	{
+		return;
+	}
+	
+	dm->full_since = 0;
+	
+	/* A reader has stopped, skip it to the head rather
+	 * than hold up every other channel */
+	for(src = st->readers; src; src = src->next)
+	{
+		if(st->head - src->pos > st->len / 2)
+		{
+			fprintf(stderr, "Warning: A reader of '%s' has stalled, skipping ahead\n", dm->url);
+			src->pos = st->head;
+		}
+	}
+}
+
+static int _demux_next(_ffmpeg_demux_t *dm)
+{
+	_ffmpeg_stream_t *st = NULL;
+	AVPacket pkt;
+	int r;
+	
+	/* Read the next packet with the lock released */
+	dm->demuxing = 1;
+	pthread_mutex_unlock(&dm->mutex);
+	
+	r = av_read_frame(dm->format_ctx, &pkt);
+	
+	pthread_mutex_lock(&dm->mutex);
+	dm->demuxing = 0;
+	pthread_cond_broadcast(&dm->cond);
+	
+	if(r < 0)
+	{
+		dm->eof = 1;
+		return(-1);
+	}
+	
+	/* Decode it if it belongs to any of the selected streams.
+	 * Streams added since opening, as MPEG-TS can, are skipped */
+	if(pkt.stream_index >= 0 && pkt.stream_index < dm->nb_streams)
+	{
+		st = dm->streams[pkt.stream_index];
+	}
+	
+	if(st && avcodec_send_packet(st->codec_ctx, &pkt) >= 0)
+	{
+		while(avcodec_receive_frame(st->codec_ctx, dm->frame) >= 0)
+		{
+			_stream_convert(st, dm->frame);
+			av_frame_unref(dm->frame);
+		}
+	}
+	
+	av_packet_unref(&pkt);
+	
+	return(0);
+}
+
+static int _src_ffmpeg_map_read(src_ffmpeg_map_t *src, int16_t *audio[2], int audio_step[2])
+{
+	_ffmpeg_demux_t *dm = src->dm;
+	_ffmpeg_stream_t *st = src->st, *full;
+	unsigned int x, n;
+	
+	pthread_mutex_lock(&dm->mutex);
+	
+	/* Demux until there is something new for this stream */
+	while(src->pos == st->head)
+	{
+		if(dm->eof)
+		{
+			pthread_mutex_unlock(&dm->mutex);
+			return(-1);
+		}
+		
+		if(dm->demuxing)
+		{
+			/* Another reader is waiting on the input */
+			pthread_mutex_unlock(&dm->mutex);
+			return(0);
+		}
+		
+		if((full = _demux_full(dm)) != NULL)
+		{
+			/* The slowest reader of a stream would be overwritten */
+			_demux_stalled(dm, full);
+			pthread_mutex_unlock(&dm->mutex);
+			return(0);
+		}
+		
+		dm->full_since = 0;
+		
+		if(_demux_next(dm) != 0)
+		{
+			pthread_mutex_unlock(&dm->mutex);
+			return(-1);
+		}
+	}
+	
+	/* A packet too large for the free half of the ring can
+	 * still overrun a reader, skip it past what was lost */
+	if(st->head - src->pos > st->len)
+	{
+		src->pos = st->head - st->len;
+	}
+	
+	x = src->pos & (st->len - 1);
+	n = st->head - src->pos;
+	if(n > st->len - x) n = st->len - x;
+	if(n > CHUNK) n = CHUNK;
+	
+	/* Copy the run while the lock is held, demuxing for
+	 * another channel may overwrite the ring once it's released */
+	memcpy(src->buf[0], &st->ring[src->map[0] * st->len + x], sizeof(int16_t) * n);
+	memcpy(src->buf[1], &st->ring[src->map[1] * st->len + x], sizeof(int16_t) * n);
+	
+	src->pos += n;
+	
+	pthread_mutex_unlock(&dm->mutex);
+	
+	audio[0] = src->buf[0];
+	audio[1] = src->buf[1];
+	audio_step[0] = audio_step[1] = 1;
+	
+	return(n);
+}
+
+static int _src_ffmpeg_map_close(src_ffmpeg_map_t *src)
+{
+	_ffmpeg_demux_t *dm = src->dm, **p;
+	src_ffmpeg_map_t **r;
+	
+	pthread_mutex_lock(&_demux_mutex);
+	
+	if(src->st)
+	{
+		/* Stop holding back the demuxer */
+		pthread_mutex_lock(&dm->mutex);
+		
+		for(r = &src->st->readers; *r; r = &(*r)->next)
+		{
+			if(*r == src)
+			{
+				*r = src->next;
+				break;
+			}
+		}
+		
+		pthread_mutex_unlock(&dm->mutex);
+	}
+	
+	if(--dm->refs == 0)
+	{
+		/* That was the last reader, remove from the registry */
+		for(p = &_demuxers; *p; p = &(*p)->next)
+		{
+			if(*p == dm)
+			{
+				*p = dm->next;
+				break;
+			}
+		}
+	}
+	else
+	{
+		dm = NULL;
+	}
+	
+	pthread_mutex_unlock(&_demux_mutex);
+	
+	if(dm) _demux_free(dm);
+	free(src);
+	
+	return(0);
+}
+
+static _ffmpeg_demux_t *_demux_open(const char *input_url)
+{
+	_ffmpeg_demux_t *dm;
+	int r;
+	
+	dm = calloc(1, sizeof(_ffmpeg_demux_t));
+	if(!dm)
+	{
+		return(NULL);
+	}
+	
+	pthread_mutex_init(&dm->mutex, NULL);
+	pthread_cond_init(&dm->cond, NULL);
+	dm->url = strdup(input_url);
+	
+	if((r = avformat_open_input(&dm->format_ctx, input_url, NULL, NULL)) < 0)
+	{
+		fprintf(stderr, "Error opening file '%s'\n", input_url);
+		_print_ffmpeg_error(r);
+		_demux_free(dm);
+		return(NULL);
+	}
+	
+	if(avformat_find_stream_info(dm->format_ctx, NULL) < 0)
+	{
+		fprintf(stderr, "Error reading stream information from file\n");
+		_demux_free(dm);
+		return(NULL);
+	}
+	
+	fprintf(stderr, "Opening '%s'...\n", input_url);
+	av_dump_format(dm->format_ctx, 0, input_url, 0);
+	
+	dm->nb_streams = dm->format_ctx->nb_streams;
+	dm->streams = calloc(dm->nb_streams, sizeof(_ffmpeg_stream_t *));
+	dm->frame = av_frame_alloc();
+	
+	if(!dm->url || !dm->streams || !dm->frame)
+	{
+		_demux_free(dm);
+		return(NULL);
+	}
+	
+	return(dm);
+}
+
+static _ffmpeg_stream_t *_stream_open(_ffmpeg_demux_t *dm, int index, int samples)
+{
+	_ffmpeg_stream_t *st;
+	AVStream *stream;
+	const AVCodec *codec;
+	
+	stream = dm->format_ctx->streams[index];
+	
+	st = calloc(1, sizeof(_ffmpeg_stream_t));
+	if(!st)
+	{
+		return(NULL);
+	}
+	
+	st->codec_ctx = avcodec_alloc_context3(NULL);
+	if(!st->codec_ctx ||
+	   avcodec_parameters_to_context(st->codec_ctx, stream->codecpar) < 0)
+	{
+		_stream_free(st);
+		return(NULL);
+	}
+	
+	st->codec_ctx->thread_count = 0; /* Let ffmpeg decide number of threads */
+	
+	codec = avcodec_find_decoder(st->codec_ctx->codec_id);
+	if(codec == NULL)
+	{
+		fprintf(stderr, "Unsupported audio codec\n");
+		_stream_free(st);
+		return(NULL);
+	}
+	
+	if(avcodec_open2(st->codec_ctx, codec, NULL) < 0)
+	{
+		fprintf(stderr, "Error opening audio codec\n");
+		_stream_free(st);
+		return(NULL);
+	}
+	
+	/* Resample to 32 kHz planar, keeping every channel */
+	st->swr_ctx = swr_alloc();
+	if(!st->swr_ctx)
+	{
+		_stream_free(st);
+		return(NULL);
+	}
+	
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 24, 100)
+	st->channels = st->codec_ctx->ch_layout.nb_channels;
+	av_opt_set_chlayout(st->swr_ctx, "in_chlayout",  &st->codec_ctx->ch_layout, 0);
+	av_opt_set_chlayout(st->swr_ctx, "out_chlayout", &st->codec_ctx->ch_layout, 0);
+#else
+	if(!st->codec_ctx->channel_layout)
+	{
+		/* Set the default layout for codecs that don't specify any */
+		st->codec_ctx->channel_layout = av_get_default_channel_layout(st->codec_ctx->channels);
+	}
+	
+	st->channels = st->codec_ctx->channels;
+	av_opt_set_int(st->swr_ctx, "in_channel_layout",  st->codec_ctx->channel_layout, 0);
+	av_opt_set_int(st->swr_ctx, "out_channel_layout", st->codec_ctx->channel_layout, 0);
+#endif
+	
+	av_opt_set_int(st->swr_ctx, "in_sample_rate",        st->codec_ctx->sample_rate, 0);
+	av_opt_set_sample_fmt(st->swr_ctx, "in_sample_fmt",  st->codec_ctx->sample_fmt, 0);
+	av_opt_set_int(st->swr_ctx, "out_sample_rate",       SRC_SAMPLE_RATE, 0);
+	av_opt_set_sample_fmt(st->swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_S16P, 0);
+	
+	if(st->channels <= 0 || swr_init(st->swr_ctx) < 0)
+	{
+		fprintf(stderr, "Failed to initialise the resampling context\n");
+		_stream_free(st);
+		return(NULL);
+	}
+	
+	/* The ring length must be a power of two */
+	for(st->len = 1; st->len < samples; st->len <<= 1);
+	
+	st->ring = malloc(sizeof(int16_t) * st->channels * st->len);
+	st->planes = malloc(sizeof(uint8_t *) * st->channels);
+	if(!st->ring || !st->planes)
+	{
+		_stream_free(st);
+		return(NULL);
+	}
+	
+	fprintf(stderr, "Using audio stream %d (%d channels).\n", index, st->channels);
+	
+	return(st);
+}
+
+int src_ffmpeg_open_map(src_t *s, const char *input_url, int stream, int map_l, int map_r, int samples)
+{
+	src_ffmpeg_map_t *src;
+	_ffmpeg_demux_t *dm, *p;
+	_ffmpeg_stream_t *st;
+	int i;
+	
+	memset(s, 0, sizeof(src_t));
+	
+	/* Use 'pipe:' for stdin */
+	if(strcmp(input_url, "-") == 0)
+	{
+		input_url = "pipe:";
+	}
+	
+	src = calloc(1, sizeof(src_ffmpeg_map_t));
+	if(!src)
+	{
+		return(-1);
+	}
+	
+	/* Reuse the demuxer if this input is already open */
+	pthread_mutex_lock(&_demux_mutex);
+	
+	for(dm = _demuxers; dm; dm = dm->next)
+	{
+		if(strcmp(dm->url, input_url) == 0) break;
+	}
+	
+	if(dm) dm->refs++;
+	
+	pthread_mutex_unlock(&_demux_mutex);
+	
+	if(!dm)
+	{
+		/* Open the input without holding the registry,
+		 * so channels on other inputs open in parallel */
+		dm = _demux_open(input_url);
+		if(!dm)
+		{
+			free(src);
+			return(-1);
+		}
+		
+		pthread_mutex_lock(&_demux_mutex);
+		
+		/* If another channel has opened the same input
+		 * in the meantime, use that one */
+		for(p = _demuxers; p; p = p->next)
+		{
+			if(strcmp(p->url, input_url) == 0) break;
+		}
+		
+		if(p)
+		{
+			p->refs++;
+		}
+		else
+		{
+			dm->refs++;
+			dm->next = _demuxers;
+			_demuxers = dm;
+		}
+		
+		pthread_mutex_unlock(&_demux_mutex);
+		
+		if(p)
+		{
+			_demux_free(dm);
+			dm = p;
+		}
+	}
+	
+	src->dm = dm;
+	
+	pthread_mutex_lock(&dm->mutex);
+	
+	/* The input may be changed while a packet is read */
+	while(dm->demuxing)
+	{
+		pthread_cond_wait(&dm->cond, &dm->mutex);
+	}
+	
+	if(stream < 0)
+	{
+		/* Default to the first audio stream */
+		for(i = 0; i < dm->nb_streams; i++)
+		{
+			if(dm->format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+			{
+				stream = i;
+				break;
+			}
+		}
+	}
+	
+	if(stream < 0 || stream >= dm->nb_streams ||
+	   dm->format_ctx->streams[stream]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+	{
+		fprintf(stderr, "Audio stream %d not found in '%s'\n", stream, input_url);
+		pthread_mutex_unlock(&dm->mutex);
+		_src_ffmpeg_map_close(src);
+		return(-1);
+	}
+	
+	/* Start decoding this stream if no other channel is using it */
+	st = dm->streams[stream];
+	
+	if(!st)
+	{
+		st = _stream_open(dm, stream, samples);
+		dm->streams[stream] = st;
+	}
+	
+	if(!st || map_l < 0 || map_l >= st->channels || map_r < 0 || map_r >= st->channels)
+	{
+		if(st) fprintf(stderr, "Channel map %d,%d is out of range for stream %d\n", map_l, map_r, stream);
+		pthread_mutex_unlock(&dm->mutex);
+		_src_ffmpeg_map_close(src);
+		return(-1);
+	}
+	
+	/* Start from the oldest audio still safely in the ring */
+	src->st = st;
+	src->map[0] = map_l;
+	src->map[1] = map_r;
+	src->pos = st->head > st->len / 2 ? st->head - st->len / 2 : 0;
+	src->next = st->readers;
+	st->readers = src;
+	
+	pthread_mutex_unlock(&dm->mutex);
+	
+	/* Register the callback functions */
+	s->private = src;
+	s->read = (src_read_t) _src_ffmpeg_map_read;
+	s->close = (src_close_t) _src_ffmpeg_map_close;
+	
+	return(0);
+}
+
 void src_ffmpeg_init(void)
 {
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
@@ -20,6 +20,11 @@
 
 extern int src_ffmpeg_open(src_t *s, const char *input_url);
 
+/* Read one or two channels of a single stream. Every channel opened on
+ * the same input shares one demuxer, and one decoder per stream. A
+ * negative stream selects the first audio stream */
+extern int src_ffmpeg_open_map(src_t *s, const char *input_url, int stream, int map_l, int map_r, int samples);
+
 extern void src_ffmpeg_init(void);
 extern void src_ffmpeg_deinit(void);
 
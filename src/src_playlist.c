@@ -0,0 +1,477 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <pthread.h>
+#include "src.h"
+
+/* Samples per cache chunk (0.25 seconds) */
+#define CHUNK (SRC_SAMPLE_RATE / 4)
+
+typedef struct _chunk_t {
+	struct _chunk_t *next;
+	int len;
+	int16_t audio[2][CHUNK];
+} _chunk_t;
+
+typedef struct {
+	
+	char *path;
+	
+	/* Decoded audio, a list of chunks */
+	_chunk_t *head;
+	_chunk_t *tail;
+	size_t samples;
+	int complete;
+	
+	/* Kept in the cache for the next time around */
+	int keep;
+	
+	/* Played chunks have been freed, can't be kept */
+	int dropped;
+	
+} _item_t;
+
+typedef struct {
+	
+	_item_t *items;
+	int nitems;
+	int repeat;
+	
+	/* How items are opened */
+	int ffmpeg;
+	int channels;
+	int rate;
+	char *format;
+	
+	/* Background decoder */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+	
+	/* Limits, in samples */
+	size_t ahead;
+	size_t cache;
+	size_t cached;
+	
+	/* Play position */
+	int play;
+	_chunk_t *chunk;
+	int pos;
+	size_t played;
+	int empty;
+	
+} src_playlist_t;
+
+static void _free_chunks(_item_t *it)
+{
+	_chunk_t *c;
+	
+	while((c = it->head) != NULL)
+	{
+		it->head = c->next;
+		free(c);
+	}
+	
+	it->tail = NULL;
+	it->samples = 0;
+	it->complete = 0;
+	it->keep = 0;
+	it->dropped = 0;
+}
+
+static int _target(src_playlist_t *pl)
+{
+	_item_t *it;
+	int i;
+	
+	/* The item to decode next is the first unfinished one out of
+	 * the current and the next, if there's room for more audio */
+	for(i = 0; i < 2; i++)
+	{
+		if(pl->play + i >= pl->nitems && !pl->repeat) break;
+		
+		it = &pl->items[(pl->play + i) % pl->nitems];
+		if(it->complete) continue;
+		
+		if(i == 0 && it->samples - pl->played >= pl->ahead) break;
+		if(i == 1 && it->samples >= pl->ahead) break;
+		
+		return((pl->play + i) % pl->nitems);
+	}
+	
+	return(-1);
+}
+
+static int _open_item(src_playlist_t *pl, src_t *src, const char *path)
+{
+#ifdef HAVE_FFMPEG
+	if(pl->ffmpeg)
+	{
+		return(src_ffmpeg_open(src, path));
+	}
+#endif
+	
+	return(src_rawaudio_open(src, path, 0, pl->channels, 0, pl->rate, pl->format, 0, 0));
+}
+
+static void *_decoder(void *arg)
+{
+	src_playlist_t *pl = arg;
+	_item_t *it;
+	_chunk_t *c;
+	src_t src;
+	size_t start = 0;
+	int open = -1;
+	int t;
+	
+	pthread_mutex_lock(&pl->mutex);
+	
+	while(!pl->quit)
+	{
+		t = _target(pl);
+		
+		if(t < 0)
+		{
+			/* Nothing to do until the player moves on */
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+			continue;
+		}
+		
+		it = &pl->items[t];
+		
+		if(open != t)
+		{
+			/* Start decoding this item */
+			pthread_mutex_unlock(&pl->mutex);
+			
+			if(open >= 0) src_close(&src);
+			open = -1;
+			
+			if(_open_item(pl, &src, it->path) == 0)
+			{
+				open = t;
+				start = it->samples;
+			}
+			else
+			{
+				fprintf(stderr, "Warning: Failed to open '%s'\n", it->path);
+			}
+			
+			pthread_mutex_lock(&pl->mutex);
+			
+			if(open < 0)
+			{
+				/* Skip it */
+				it->complete = 1;
+				pthread_cond_broadcast(&pl->cond);
+			}
+			
+			continue;
+		}
+		
+		/* Decode the next chunk without holding the lock */
+		pthread_mutex_unlock(&pl->mutex);
+		
+		c = malloc(sizeof(_chunk_t));
+		if(c)
+		{
+			c->next = NULL;
+			c->len = src_read_block(&src, c->audio[0], c->audio[1], CHUNK);
+		}
+		
+		pthread_mutex_lock(&pl->mutex);
+		
+		if(c && c->len > 0)
+		{
+			if(it->tail) it->tail->next = c;
+			else it->head = c;
+			it->tail = c;
+			it->samples += c->len;
+		}
+		
+		if(!c || c->len < CHUNK)
+		{
+			/* End of the item, or out of memory */
+			if(c && c->len <= 0) free(c);
+			
+			/* A lone repeating item too big to keep carries straight
+			 * on into its next time around. Decoding it again only
+			 * once it had played through would leave a gap */
+			if(!c || !pl->repeat || pl->nitems > 1 || it->samples == start ||
+			   (!it->dropped && pl->cached + it->samples <= pl->cache))
+			{
+				it->complete = 1;
+			}
+			
+			pthread_mutex_unlock(&pl->mutex);
+			src_close(&src);
+			pthread_mutex_lock(&pl->mutex);
+			
+			open = -1;
+		}
+		
+		pthread_cond_broadcast(&pl->cond);
+	}
+	
+	pthread_mutex_unlock(&pl->mutex);
+	
+	if(open >= 0) src_close(&src);
+	
+	return(NULL);
+}
+
+static void _next_item(src_playlist_t *pl)
+{
+	_item_t *it = &pl->items[pl->play];
+	
+	/* Keep the whole item if it fits in the cache,
+	 * otherwise free it to be decoded again */
+	if(!it->keep)
+	{
+		if(pl->repeat && !it->dropped && pl->cached + it->samples <= pl->cache)
+		{
+			it->keep = 1;
+			pl->cached += it->samples;
+		}
+		else
+		{
+			_free_chunks(it);
+		}
+	}
+	
+	pl->empty = (pl->played == 0 ? pl->empty + 1 : 0);
+	pl->play++;
+	if(pl->repeat) pl->play %= pl->nitems;
+	
+	pl->chunk = NULL;
+	pl->pos = 0;
+	pl->played = 0;
+}
+
+static int _src_playlist_read(src_playlist_t *pl, int16_t *audio[2], int audio_step[2])
+{
+	_item_t *it;
+	_chunk_t *c;
+	int n;
+	
+	pthread_mutex_lock(&pl->mutex);
+	
+	while(1)
+	{
+		if(pl->play >= pl->nitems || pl->empty >= pl->nitems)
+		{
+			/* End of the playlist, or nothing in it is playable */
+			pthread_mutex_unlock(&pl->mutex);
+			return(-1);
+		}
+		
+		it = &pl->items[pl->play];
+		
+		if(pl->chunk == NULL)
+		{
+			pl->chunk = it->head;
+			pl->pos = 0;
+		}
+		else if(pl->pos == pl->chunk->len && pl->chunk->next)
+		{
+			c = pl->chunk;
+			pl->chunk = c->next;
+			pl->pos = 0;
+			
+			if(!it->keep && (!pl->repeat || pl->cached + it->samples > pl->cache))
+			{
+				/* This item won't fit in the cache, free as we go */
+				it->head = pl->chunk;
+				it->dropped = 1;
+				free(c);
+			}
+		}
+		
+		if(pl->chunk && pl->pos < pl->chunk->len)
+		{
+			/* Play the rest of this chunk */
+			n = pl->chunk->len - pl->pos;
+			audio[0] = &pl->chunk->audio[0][pl->pos];
+			audio[1] = &pl->chunk->audio[1][pl->pos];
+			audio_step[0] = audio_step[1] = 1;
+			
+			pl->pos += n;
+			pl->played += n;
+			
+			pthread_cond_broadcast(&pl->cond);
+			pthread_mutex_unlock(&pl->mutex);
+			
+			return(n);
+		}
+		
+		if(it->complete && (!pl->chunk || !pl->chunk->next))
+		{
+			/* Move straight on to the next item */
+			_next_item(pl);
+			pthread_cond_broadcast(&pl->cond);
+			continue;
+		}
+		
+		/* Wait for the decoder to catch up */
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	}
+}
+
+static int _src_playlist_close(src_playlist_t *pl)
+{
+	int i;
+	
+	if(pl->thread)
+	{
+		pthread_mutex_lock(&pl->mutex);
+		pl->quit = 1;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->mutex);
+		
+		pthread_join(pl->thread, NULL);
+	}
+	
+	for(i = 0; i < pl->nitems; i++)
+	{
+		_free_chunks(&pl->items[i]);
+		free(pl->items[i].path);
+	}
+	
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->mutex);
+	free(pl->items);
+	free(pl->format);
+	free(pl);
+	
+	return(0);
+}
+
+static int _load(src_playlist_t *pl, const char *filename)
+{
+	char line[4096], *dir, *p, *e;
+	_item_t *items;
+	FILE *f;
+	
+	f = fopen(filename, "r");
+	if(!f)
+	{
+		perror(filename);
+		return(-1);
+	}
+	
+	/* Relative paths are relative to the playlist */
+	p = strdup(filename);
+	dir = p ? strdup(dirname(p)) : NULL;
+	free(p);
+	
+	while(dir && fgets(line, sizeof(line), f))
+	{
+		/* Trim whitespace, skip blank lines and comments */
+		for(p = line; *p == ' ' || *p == '\t'; p++);
+		for(e = p + strlen(p); e > p && (e[-1] == '\n' || e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t'); e--);
+		*e = '\0';
+		
+		if(*p == '\0' || *p == '#') continue;
+		
+		items = realloc(pl->items, sizeof(_item_t) * (pl->nitems + 1));
+		if(!items) break;
+		pl->items = items;
+		
+		memset(&pl->items[pl->nitems], 0, sizeof(_item_t));
+		
+		if(*p == '/' || strstr(p, "://") || strcmp(p, "-") == 0)
+		{
+			pl->items[pl->nitems].path = strdup(p);
+		}
+		else
+		{
+			pl->items[pl->nitems].path = malloc(strlen(dir) + strlen(p) + 2);
+			if(pl->items[pl->nitems].path)
+			{
+				sprintf(pl->items[pl->nitems].path, "%s/%s", dir, p);
+			}
+		}
+		
+		if(!pl->items[pl->nitems].path) break;
+		pl->nitems++;
+	}
+	
+	free(dir);
+	fclose(f);
+	
+	if(pl->nitems == 0)
+	{
+		fprintf(stderr, "%s: Playlist is empty\n", filename);
+		return(-1);
+	}
+	
+	return(0);
+}
+
+int src_playlist_open(src_t *s, const char *filename, int repeat, int ffmpeg, int channels, int rate, const char *format, double ahead, double cache)
+{
+	src_playlist_t *pl;
+	
+	memset(s, 0, sizeof(src_t));
+	
+	pl = calloc(1, sizeof(src_playlist_t));
+	if(!pl)
+	{
+		return(-1);
+	}
+	
+	pl->repeat = repeat;
+	pl->ffmpeg = ffmpeg;
+	pl->channels = channels;
+	pl->rate = rate;
+	pl->format = strdup(format);
+	pl->ahead = ahead * SRC_SAMPLE_RATE;
+	pl->cache = cache * SRC_SAMPLE_RATE;
+	
+	if(pl->ahead < CHUNK) pl->ahead = CHUNK;
+	
+	pthread_mutex_init(&pl->mutex, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+	
+	if(!pl->format || _load(pl, filename) != 0)
+	{
+		_src_playlist_close(pl);
+		return(-1);
+	}
+	
+	if(pthread_create(&pl->thread, NULL, _decoder, pl) != 0)
+	{
+		perror("pthread_create");
+		pl->thread = 0;
+		_src_playlist_close(pl);
+		return(-1);
+	}
+	
+	/* Register the callback functions */
+	s->private = pl;
+	s->read = (src_read_t) _src_playlist_read;
+	s->close = (src_close_t) _src_playlist_close;
+	
+	return(0);
+}
+
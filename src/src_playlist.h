@@ -0,0 +1,34 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _SRC_PLAYLIST_H
+#define _SRC_PLAYLIST_H
+
+/* Plays the files listed in a playlist, one per line, back to back. A
+ * background thread decodes up to ahead seconds beyond the play position,
+ * running on into the next item before the current one ends, so each
+ * item follows the last without a gap.
+ * 
+ * With repeat, items are kept once decoded for the next time around,
+ * up to cache seconds in total. Items are opened with ffmpeg, or as raw
+ * audio with the given channels, rate and format.
+*/
+
+extern int src_playlist_open(src_t *s, const char *filename, int repeat, int ffmpeg, int channels, int rate, const char *format, double ahead, double cache);
+
+#endif
+
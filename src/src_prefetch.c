@@ -0,0 +1,579 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include "src.h"
+#include "resample.h"
+
+/* Maximum number of samples read from a source in one go (20ms) */
+#define CHUNK (SRC_SAMPLE_RATE / 50)
+
+/* How long closing waits for a worker still reading the source (ns) */
+#define CLOSE_TIMEOUT 1000000000L
+
+/* Length of silence returned when the ring is empty (one DSR block) */
+#define SILENCE 64
+
+/* Drift compensation loop constants. The fill level is averaged over
+ * roughly a second of blocks, and the correction is limited to 1000ppm */
+#define LEVEL_ALPHA (1.0 / 500)
+#define DRIFT_KP    4e-3
+#define DRIFT_KI    5e-7
+#define DRIFT_MAX   1e-3
+
+typedef struct {
+	
+	src_pool_t *pool;
+	
+	/* The wrapped source, only touched by the worker holding busy */
+	src_t src;
+	atomic_flag busy;
+	
+	/* Set while the source has nothing ready, cleared each time the
+	 * workers wake up. Detached once closed while still being read */
+	atomic_int idle;
+	int detached;
+	
+	/* Audio ring, planar stereo. The head is only
+	 * advanced by the workers and the tail by the consumer */
+	int16_t *ring[2];
+	unsigned int len;
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_int eof;
+	
+	/* Samples returned to the consumer by the last read */
+	unsigned int last;
+	
+	int primed;
+	unsigned long underruns;
+	int16_t silence[SILENCE];
+	
+	/* Adaptive clock drift compensation */
+	int adaptive;
+	resample_t rs;
+	unsigned int target;
+	int running;
+	double level;
+	double integral;
+	int16_t out[2][SILENCE];
+	
+} src_prefetch_t;
+
+static void _timeout(struct timespec *ts, long ns)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	
+	ts->tv_nsec += ns;
+	if(ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static unsigned int _space(src_prefetch_t *p)
+{
+	unsigned int head = atomic_load_explicit(&p->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+	
+	return(p->len - (head - tail));
+}
+
+static void _fill(src_prefetch_t *p)
+{
+	unsigned int head, x, n;
+	int r;
+	
+	/* Read as much as will fit in the ring without wrapping */
+	head = atomic_load_explicit(&p->head, memory_order_relaxed);
+	x = head & (p->len - 1);
+	
+	n = _space(p);
+	if(n > p->len - x) n = p->len - x;
+	if(n > CHUNK) n = CHUNK;
+	
+	r = src_read_block(&p->src, &p->ring[0][x], &p->ring[1][x], n);
+	
+	if(r > 0)
+	{
+		atomic_store_explicit(&p->head, head + r, memory_order_release);
+	}
+	
+	if(r < n && src_eof(&p->src))
+	{
+		atomic_store_explicit(&p->eof, 1, memory_order_release);
+	}
+	else if(r < n)
+	{
+		/* Nothing more ready yet, try the other sources first */
+		atomic_store_explicit(&p->idle, 1, memory_order_relaxed);
+	}
+}
+
+static void _free(src_prefetch_t *p)
+{
+	if(p->underruns > 0)
+	{
+		fprintf(stderr, "Source buffer underran %lu times\n", p->underruns);
+	}
+	
+	src_close(&p->src);
+	resample_free(&p->rs);
+	free(p->ring[0]);
+	free(p);
+}
+
+static void *_worker(void *arg)
+{
+	src_pool_t *pool = arg;
+	src_prefetch_t *p;
+	struct timespec ts;
+	int i;
+	
+	pthread_mutex_lock(&pool->mutex);
+	
+	while(!pool->quit)
+	{
+		/* Find the next source with room for another chunk */
+		for(p = NULL, i = 0; i < pool->nsrcs; i++)
+		{
+			p = pool->srcs[(pool->next + i) % pool->nsrcs];
+			
+			if(!atomic_load(&p->eof) &&
+			   !atomic_load_explicit(&p->idle, memory_order_relaxed) &&
+			   _space(p) >= CHUNK &&
+			   !atomic_flag_test_and_set(&p->busy))
+			{
+				break;
+			}
+			
+			p = NULL;
+		}
+		
+		if(p == NULL)
+		{
+			/* Nothing to do, sleep until woken or 1ms has passed */
+			_timeout(&ts, 1000000L);
+			pthread_cond_timedwait(&pool->cond, &pool->mutex, &ts);
+			
+			/* Try the sources that had nothing ready again */
+			for(i = 0; i < pool->nsrcs; i++)
+			{
+				p = pool->srcs[i];
+				atomic_store_explicit(&p->idle, 0, memory_order_relaxed);
+			}
+			
+			continue;
+		}
+		
+		/* Start the next search after this source */
+		pool->next = (pool->next + i + 1) % pool->nsrcs;
+		
+		pthread_mutex_unlock(&pool->mutex);
+		_fill(p);
+		pthread_mutex_lock(&pool->mutex);
+		
+		atomic_flag_clear(&p->busy);
+		
+		if(p->detached)
+		{
+			/* Closed while this worker was reading from it */
+			pthread_mutex_unlock(&pool->mutex);
+			_free(p);
+			pthread_mutex_lock(&pool->mutex);
+		}
+		
+		pthread_cond_broadcast(&pool->done);
+		
+		if(pool->blocking)
+		{
+			pthread_cond_broadcast(&pool->data);
+		}
+	}
+	
+	pthread_mutex_unlock(&pool->mutex);
+	
+	return(NULL);
+}
+
+static int _read_adaptive(src_prefetch_t *p, int16_t *audio[2], int audio_step[2])
+{
+	const int step[2] = { 1, 1 };
+	int16_t *in[2], *out[2];
+	unsigned int head, tail, x, n, r;
+	double err, ratio;
+	
+	audio[0] = &p->out[0][0];
+	audio[1] = &p->out[1][0];
+	audio_step[0] = audio_step[1] = 1;
+	
+	tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&p->head, memory_order_acquire);
+	
+	if(!p->running)
+	{
+		if(head == tail &&
+		   atomic_load_explicit(&p->eof, memory_order_acquire) &&
+		   atomic_load_explicit(&p->head, memory_order_acquire) == tail)
+		{
+			return(-1);
+		}
+		
+		/* Play silence until the buffer has filled to its target */
+		if(head - tail < p->target)
+		{
+			memset(p->out, 0, sizeof(p->out));
+			return(SILENCE);
+		}
+		
+		p->running = 1;
+		p->level = p->target;
+		p->primed = 1;
+	}
+	
+	/* Track the average fill level, and nudge the resampling
+	 * ratio to hold it at the target */
+	p->level += ((double) (head - tail) - p->level) * LEVEL_ALPHA;
+	err = (p->level - p->target) / p->target;
+	
+	p->integral += err * DRIFT_KI;
+	if(p->integral > DRIFT_MAX) p->integral = DRIFT_MAX;
+	else if(p->integral < -DRIFT_MAX) p->integral = -DRIFT_MAX;
+	
+	ratio = err * DRIFT_KP + p->integral;
+	if(ratio > DRIFT_MAX) ratio = DRIFT_MAX;
+	else if(ratio < -DRIFT_MAX) ratio = -DRIFT_MAX;
+	
+	resample_ratio(&p->rs, 1.0 + ratio);
+	
+	/* Feed the resampler from the ring until a full block is ready */
+	for(n = 0; n < SILENCE;)
+	{
+		out[0] = &p->out[0][n];
+		out[1] = &p->out[1][n];
+		n += resample_read(&p->rs, out, step, SILENCE - n);
+		if(n == SILENCE) break;
+		
+		if(head == tail)
+		{
+			/* Starved. Pad with silence and refill to the target */
+			memset(&p->out[0][n], 0, sizeof(int16_t) * (SILENCE - n));
+			memset(&p->out[1][n], 0, sizeof(int16_t) * (SILENCE - n));
+			p->underruns++;
+			p->running = 0;
+			break;
+		}
+		
+		/* Feed the resampler a block at a time, to keep
+		 * the audio it holds out of sight short */
+		x = tail & (p->len - 1);
+		r = head - tail;
+		if(r > p->len - x) r = p->len - x;
+		if(r > SILENCE) r = SILENCE;
+		
+		in[0] = &p->ring[0][x];
+		in[1] = &p->ring[1][x];
+		tail += resample_write(&p->rs, in, step, r);
+	}
+	
+	atomic_store_explicit(&p->tail, tail, memory_order_release);
+	
+	return(SILENCE);
+}
+
+static int _src_prefetch_read(src_prefetch_t *p, int16_t *audio[2], int audio_step[2])
+{
+	src_pool_t *pool = p->pool;
+	unsigned int head, tail, x, n;
+	struct timespec ts;
+	
+	if(p->adaptive)
+	{
+		pthread_cond_signal(&pool->cond);
+		return(_read_adaptive(p, audio, audio_step));
+	}
+	
+	/* Release the samples returned by the previous read */
+	tail = atomic_load_explicit(&p->tail, memory_order_relaxed) + p->last;
+	atomic_store_explicit(&p->tail, tail, memory_order_release);
+	p->last = 0;
+	
+	/* Nudge a worker, the ring may have room for another chunk */
+	pthread_cond_signal(&pool->cond);
+	
+	head = atomic_load_explicit(&p->head, memory_order_acquire);
+	
+	if(head == tail && pool->blocking)
+	{
+		/* Not a live output, wait for the workers to catch up */
+		pthread_mutex_lock(&pool->mutex);
+		
+		while((head = atomic_load_explicit(&p->head, memory_order_acquire)) == tail &&
+		      !atomic_load_explicit(&p->eof, memory_order_acquire))
+		{
+			_timeout(&ts, 10000000L);
+			pthread_cond_timedwait(&pool->data, &pool->mutex, &ts);
+		}
+		
+		pthread_mutex_unlock(&pool->mutex);
+	}
+	
+	if(head == tail)
+	{
+		if(atomic_load_explicit(&p->eof, memory_order_acquire) &&
+		   atomic_load_explicit(&p->head, memory_order_acquire) == tail)
+		{
+			return(-1);
+		}
+		
+		/* Starved. Return silence, but don't count a source that
+		 * has yet to produce any audio as an underrun */
+		if(p->primed) p->underruns++;
+		
+		audio[0] = audio[1] = p->silence;
+		audio_step[0] = audio_step[1] = 1;
+		
+		return(SILENCE);
+	}
+	
+	p->primed = 1;
+	
+	/* Return the available samples up to the end of the ring */
+	x = tail & (p->len - 1);
+	n = head - tail;
+	if(n > p->len - x) n = p->len - x;
+	
+	audio[0] = &p->ring[0][x];
+	audio[1] = &p->ring[1][x];
+	audio_step[0] = audio_step[1] = 1;
+	
+	p->last = n;
+	
+	return(n);
+}
+
+static int _src_prefetch_close(src_prefetch_t *p)
+{
+	src_pool_t *pool = p->pool;
+	struct timespec ts;
+	int i;
+	
+	/* Unregister this source from the pool */
+	pthread_mutex_lock(&pool->mutex);
+	
+	for(i = 0; i < pool->nsrcs; i++)
+	{
+		if(pool->srcs[i] == p)
+		{
+			memmove(&pool->srcs[i], &pool->srcs[i + 1], sizeof(void *) * (pool->nsrcs - i - 1));
+			pool->nsrcs--;
+			pool->next = 0;
+			break;
+		}
+	}
+	
+	/* Wait for any worker still reading from it. A source blocked
+	 * for longer is left for that worker to close when it returns */
+	_timeout(&ts, CLOSE_TIMEOUT);
+	
+	while(atomic_flag_test_and_set(&p->busy))
+	{
+		if(pthread_cond_timedwait(&pool->done, &pool->mutex, &ts) == ETIMEDOUT)
+		{
+			fprintf(stderr, "Warning: Source is still reading, closing it in the background\n");
+			p->detached = 1;
+			pthread_mutex_unlock(&pool->mutex);
+			return(0);
+		}
+	}
+	
+	pthread_mutex_unlock(&pool->mutex);
+	
+	_free(p);
+	
+	return(0);
+}
+
+int src_prefetch_open(src_t *s, src_pool_t *pool, src_t *src, int samples, int latency)
+{
+	src_prefetch_t *p;
+	
+	memset(s, 0, sizeof(src_t));
+	
+	p = calloc(1, sizeof(src_prefetch_t));
+	if(!p)
+	{
+		return(-1);
+	}
+	
+	/* The ring length must be a power of two, and for drift
+	 * compensation at least twice the target latency */
+	if(samples < CHUNK * 2) samples = CHUNK * 2;
+	if(samples < latency * 2) samples = latency * 2;
+	for(p->len = 1; p->len < samples; p->len <<= 1);
+	
+	p->ring[0] = malloc(sizeof(int16_t) * 2 * p->len);
+	p->ring[1] = p->ring[0] + p->len;
+	if(!p->ring[0])
+	{
+		free(p);
+		return(-1);
+	}
+	
+	p->pool = pool;
+	p->src = *src;
+	atomic_flag_clear(&p->busy);
+	atomic_init(&p->idle, 0);
+	atomic_init(&p->head, 0);
+	atomic_init(&p->tail, 0);
+	atomic_init(&p->eof, 0);
+	
+	if(latency > 0)
+	{
+		/* Hold the buffer at the target level by resampling */
+		if(resample_init(&p->rs, 2, 1.0) != 0)
+		{
+			free(p->ring[0]);
+			free(p);
+			return(-1);
+		}
+		
+		p->adaptive = 1;
+		p->target = latency;
+	}
+	
+	/* Register the callback functions */
+	s->private = p;
+	s->read = (src_read_t) _src_prefetch_read;
+	s->close = (src_close_t) _src_prefetch_close;
+	
+	/* Drift compensation breaks up any repeating pattern */
+	s->period = p->adaptive ? 0 : src->period;
+	
+	/* Hand the source over to the workers */
+	pthread_mutex_lock(&pool->mutex);
+	
+	if(pool->nsrcs == SRC_POOL_MAX)
+	{
+		pthread_mutex_unlock(&pool->mutex);
+		fprintf(stderr, "Too many prefetch sources\n");
+		resample_free(&p->rs);
+		free(p->ring[0]);
+		free(p);
+		memset(s, 0, sizeof(src_t));
+		return(-1);
+	}
+	
+	pool->srcs[pool->nsrcs++] = p;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	
+	return(0);
+}
+
+unsigned long src_prefetch_underruns(src_t *s)
+{
+	if(!s || s->read != (src_read_t) _src_prefetch_read) return(0);
+	return(((src_prefetch_t *) s->private)->underruns);
+}
+
+int src_prefetch_primed(src_t *s)
+{
+	if(!s || s->read != (src_read_t) _src_prefetch_read) return(1);
+	return(((src_prefetch_t *) s->private)->primed);
+}
+
+int src_pool_init(src_pool_t *pool, int threads, int blocking)
+{
+	int i;
+	
+	memset(pool, 0, sizeof(src_pool_t));
+	
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->data, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->blocking = blocking;
+	
+	if(threads < 1) threads = 1;
+	
+	pool->threads = calloc(threads, sizeof(pthread_t));
+	if(!pool->threads)
+	{
+		return(-1);
+	}
+	
+	for(i = 0; i < threads; i++)
+	{
+		if(pthread_create(&pool->threads[i], NULL, _worker, pool) != 0)
+		{
+			perror("pthread_create");
+			src_pool_free(pool);
+			return(-1);
+		}
+		
+		pool->nthreads++;
+	}
+	
+	return(0);
+}
+
+void src_pool_free(src_pool_t *pool)
+{
+	struct timespec ts;
+	int i, stuck = 0;
+	
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	
+	_timeout(&ts, CLOSE_TIMEOUT);
+	
+	for(i = 0; i < pool->nthreads; i++)
+	{
+		/* Don't hang on a worker blocked in a source */
+		if(pthread_timedjoin_np(pool->threads[i], NULL, &ts) != 0)
+		{
+			pthread_detach(pool->threads[i]);
+			stuck++;
+		}
+	}
+	
+	if(stuck)
+	{
+		/* Leave the pool to the workers still running */
+		fprintf(stderr, "Warning: %d source worker%s still reading\n", stuck, stuck == 1 ? " is" : "s are");
+		return;
+	}
+	
+	free(pool->threads);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->data);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	memset(pool, 0, sizeof(src_pool_t));
+}
+
@@ -0,0 +1,66 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _SRC_PREFETCH_H
+#define _SRC_PREFETCH_H
+
+#include <pthread.h>
+
+/* The prefetch source wraps another source and decodes it ahead of time
+ * on a shared pool of worker threads. The consumer only ever copies out of
+ * a lock-free ring. If the ring runs dry on a live output the consumer
+ * receives silence and the underrun counter is incremented, rather than
+ * blocking the whole multiplex.
+ * 
+ * With a non-zero latency (in samples) the source is treated as running
+ * on its own clock. The ring is held at that fill level by resampling
+ * the audio by up to 1000ppm, so the buffer neither drains nor grows.
+*/
+
+#define SRC_POOL_MAX 64
+
+typedef struct {
+	
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t data;
+	pthread_cond_t done;
+	
+	/* Worker threads */
+	pthread_t *threads;
+	int nthreads;
+	int quit;
+	
+	/* Registered sources */
+	void *srcs[SRC_POOL_MAX];
+	int nsrcs;
+	int next;
+	
+	/* Block the consumer rather than insert silence */
+	int blocking;
+	
+} src_pool_t;
+
+extern int src_pool_init(src_pool_t *pool, int threads, int blocking);
+extern void src_pool_free(src_pool_t *pool);
+
+extern int src_prefetch_open(src_t *s, src_pool_t *pool, src_t *src, int samples, int latency);
+extern unsigned long src_prefetch_underruns(src_t *s);
+extern int src_prefetch_primed(src_t *s);
+
+#endif
+
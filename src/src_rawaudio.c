@@ -15,11 +15,73 @@
 /* You should have received a copy of the GNU General Public License     */
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "src.h"
+#include "resample.h"
+
+/* Audio returned per read from a memory mapped file (1 second) */
+#define MAP_CHUNK SRC_SAMPLE_RATE
+
+/* Frames converted per read when the input needs converting */
+#define CONVERT_CHUNK 1024
+
+/* Requested pipe size for commands (1 MiB) */
+#define PIPE_SIZE (1 << 20)
+
+/* Restart delay for commands that exit, doubling up to the maximum.
+ * The delay is reset once a command has run for RESTART_RESET seconds */
+#define RESTART_MIN   1.0
+#define RESTART_MAX   30.0
+#define RESTART_RESET 10.0
+
+/* How long a command has to exit before it is killed */
+#define REAP_TIMEOUT 1.0
+
+extern char **environ;
+
+enum {
+	_S16 = 0,	/* Native byte order */
+	_S16_SWAP,
+	_S24LE,
+	_S24BE,
+	_F32,
+};
+
+static const struct {
+	const char *name;
+	int format;
+	int bytes;
+} _formats[] = {
+	{ "s16",   _S16,   2 },
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{ "s16le", _S16,      2 },
+	{ "s16be", _S16_SWAP, 2 },
+#else
+	{ "s16le", _S16_SWAP, 2 },
+	{ "s16be", _S16,      2 },
+#endif
+	{ "s24",   _S24LE, 3 },
+	{ "s24le", _S24LE, 3 },
+	{ "s24be", _S24BE, 3 },
+	{ "f32",   _F32,   4 },
+	{ "f32le", _F32,   4 },
+	{ NULL }
+};
 
 typedef struct {
 	
@@ -31,8 +93,109 @@ typedef struct {
 	int channels;
 	int repeat;
 	
+	/* Input format */
+	int format;
+	int frame_size;
+	
+	/* Memory mapped regular files */
+	uint8_t *map;
+	size_t map_size;
+	size_t frames;
+	size_t pos;
+	
+	/* Commands are run directly, or through the shell if needed */
+	char **argv;
+	pid_t pid;
+	int fd;
+	int rate;
+	double stall;
+	double stall_restart;
+	double last_read;
+	double silent_at;
+	uint8_t *partial;
+	int carry;
+	double started;
+	double restart_at;
+	double backoff;
+	unsigned long stalls;
+	unsigned long restarts;
+	
+	/* Converted planar audio, and the resampler when
+	 * the input is not at the DSR sample rate */
+	uint8_t *raw;
+	int16_t *conv[2];
+	int conv_n;
+	int conv_pos;
+	int resample;
+	resample_t rs;
+	
 } src_rawaudio_t;
 
+static void _map_audio(src_rawaudio_t *src, int16_t *p, int16_t *audio[2], int audio_step[2])
+{
+	if(src->channels == 1)
+	{
+		/* Mono, mapped to two stereo tracks */
+		audio[0] = audio[1] = p;
+		audio_step[0] = audio_step[1] = 1;
+	}
+	else
+	{
+		/* Stereo */
+		audio[0] = p + 0;
+		audio[1] = p + 1;
+		audio_step[0] = audio_step[1] = 2;
+	}
+}
+
+static void _map_conv(src_rawaudio_t *src, int16_t *audio[2], int audio_step[2])
+{
+	audio[0] = src->conv[0] + src->conv_pos;
+	audio[1] = src->conv[src->channels == 1 ? 0 : 1] + src->conv_pos;
+	audio_step[0] = audio_step[1] = 1;
+}
+
+static size_t _next_map(src_rawaudio_t *src, uint8_t **p, size_t frames)
+{
+	size_t n, o, l;
+	long page;
+	
+	/* Return the next run of frames straight from the mapping */
+	n = src->frames - src->pos;
+	if(n > frames) n = frames;
+	
+	*p = src->map + src->pos * src->frame_size;
+	src->pos += n;
+	
+	/* Ask the kernel to start reading in the next chunk */
+	page = sysconf(_SC_PAGESIZE);
+	o = src->pos * src->frame_size;
+	if(o == src->map_size) o = 0;
+	l = MAP_CHUNK * src->frame_size;
+	if(l > src->map_size - o) l = src->map_size - o;
+	madvise(src->map + (o & ~(page - 1)), l + (o & (page - 1)), MADV_WILLNEED);
+	
+	return(n);
+}
+
+static int _src_rawaudio_read_map(src_rawaudio_t *src, int16_t *audio[2], int audio_step[2])
+{
+	uint8_t *p;
+	size_t n;
+	
+	if(src->pos == src->frames)
+	{
+		/* EOF -- jump back to the beginning or signal EOF */
+		if(src->repeat) src->pos = 0;
+		else return(-1);
+	}
+	
+	n = _next_map(src, &p, MAP_CHUNK);
+	_map_audio(src, (int16_t *) p, audio, audio_step);
+	
+	return(n);
+}
+
 static int _src_rawaudio_read(src_rawaudio_t *src, int16_t *audio[2], int audio_step[2])
 {
 	int i;
@@ -46,38 +209,536 @@ static int _src_rawaudio_read(src_rawaudio_t *src, int16_t *audio[2], int audio_
 	
 	i = fread(src->audio, sizeof(int16_t) * src->channels, src->audio_len, src->f);
 	
-	if(src->channels == 1)
+	_map_audio(src, src->audio, audio, audio_step);
+	
+	return(i);
+}
+
+static double _now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static char **_split_args(const char *cmd)
+{
+	const char *meta = "|&;<>()$`*?[]{}~#\n";
+	char **argv, *d;
+	int n, q;
+	
+	/* Room for the pointers and a copy of the string */
+	n = strlen(cmd);
+	argv = malloc(sizeof(char *) * (n / 2 + 4) + n + 1);
+	if(!argv) return(NULL);
+	
+	d = (char *) &argv[n / 2 + 4];
+	
+	if(strpbrk(cmd, meta))
 	{
-		/* Mono, mapped to two stereo tracks */
-		audio[0] = audio[1] = src->audio;
-		audio_step[0] = audio_step[1] = 1;
+		/* Needs a shell to run */
+		argv[0] = "/bin/sh";
+		argv[1] = "-c";
+		argv[2] = strcpy(d, cmd);
+		argv[3] = NULL;
+		return(argv);
 	}
-	else
+	
+	/* Split on whitespace, honouring quotes and backslashes */
+	for(n = 0; *cmd; )
 	{
-		/* Stereo */
-		audio[0] = src->audio + 0;
-		audio[1] = src->audio + 1;
-		audio_step[0] = audio_step[1] = 2;
+		if(*cmd == ' ' || *cmd == '\t')
+		{
+			cmd++;
+			continue;
+		}
+		
+		argv[n++] = d;
+		
+		for(q = 0; *cmd && (q || (*cmd != ' ' && *cmd != '\t')); cmd++)
+		{
+			if(q == 0 && (*cmd == '"' || *cmd == '\'')) q = *cmd;
+			else if(q && *cmd == q) q = 0;
+			else if(*cmd == '\\' && q != '\'' && cmd[1]) *d++ = *++cmd;
+			else *d++ = *cmd;
+		}
+		
+		*d++ = '\0';
+	}
+	
+	argv[n] = NULL;
+	
+	return(argv);
+}
+
+static int _spawn(src_rawaudio_t *src)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	int fds[2];
+	int r;
+	
+	if(pipe2(fds, O_CLOEXEC) != 0)
+	{
+		perror("pipe2");
+		return(-1);
 	}
 	
+	/* A larger pipe means fewer, bigger reads. This can fail if
+	 * over the system limit, which is not an error */
+	fcntl(fds[0], F_SETPIPE_SZ, PIPE_SIZE);
+	
+	/* The child's stdout is the write end of the pipe */
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+	
+	/* Run it in its own process group, so anything it
+	 * starts can be stopped along with it */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+	
+	r = posix_spawnp(&src->pid, src->argv[0], &fa, &attr, src->argv, environ);
+	
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	close(fds[1]);
+	
+	if(r != 0)
+	{
+		fprintf(stderr, "%s: %s\n", src->argv[0], strerror(r));
+		close(fds[0]);
+		src->pid = 0;
+		return(-1);
+	}
+	
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	src->fd = fds[0];
+	src->carry = 0;
+	src->started = src->last_read = _now();
+	
+	return(0);
+}
+
+static void _reap(src_rawaudio_t *src)
+{
+	struct timespec ts = { 0, 10000000 };
+	double t;
+	
+	if(src->pid == 0) return;
+	
+	close(src->fd);
+	src->fd = -1;
+	
+	/* Ask the command to stop, killing it if it doesn't in time */
+	kill(-src->pid, SIGTERM);
+	
+	for(t = _now() + REAP_TIMEOUT; waitpid(src->pid, NULL, WNOHANG) == 0; )
+	{
+		if(_now() >= t)
+		{
+			fprintf(stderr, "Warning: '%s' did not exit, killing it\n", src->argv[src->argv[1] && strcmp(src->argv[1], "-c") == 0 ? 2 : 0]);
+			kill(-src->pid, SIGKILL);
+			waitpid(src->pid, NULL, 0);
+			break;
+		}
+		
+		nanosleep(&ts, NULL);
+	}
+	
+	src->pid = 0;
+}
+
+static int _silence(src_rawaudio_t *src, uint8_t *buf, int frames)
+{
+	double t = _now();
+	int n;
+	
+	/* Without a stall timeout the source just waits */
+	if(src->stall <= 0) return(0);
+	
+	/* Play silence at the sample rate, from when it started */
+	if(src->silent_at == 0) src->silent_at = t;
+	
+	n = (t - src->silent_at) * src->rate;
+	if(n > frames) n = frames;
+	if(n < 1) return(0);
+	
+	src->silent_at += (double) n / src->rate;
+	
+	/* Zero is silence in every supported format */
+	memset(buf, 0, n * src->frame_size);
+	
+	return(n);
+}
+
+static void _restart(src_rawaudio_t *src)
+{
+	double t = _now() - src->started;
+	
+	_reap(src);
+	
+	/* Restart with a growing delay, unless it ran for a while */
+	if(t >= RESTART_RESET) src->backoff = RESTART_MIN;
+	else src->backoff = src->backoff * 2 < RESTART_MAX ? src->backoff * 2 : RESTART_MAX;
+	
+	src->restart_at = _now() + src->backoff;
+	src->restarts++;
+}
+
+static int _read_pipe(src_rawaudio_t *src, uint8_t *buf, int frames)
+{
+	ssize_t r;
+	double t;
+	int n;
+	
+	/* This never waits. When there is nothing to read it returns
+	 * silence if the command has stalled, or nothing yet */
+	while(1)
+	{
+		if(src->pid == 0)
+		{
+			/* The command has exited, wait for the restart */
+			if(_now() < src->restart_at)
+			{
+				return(_silence(src, buf, frames));
+			}
+			
+			if(_spawn(src) != 0)
+			{
+				src->backoff = src->backoff * 2 < RESTART_MAX ? src->backoff * 2 : RESTART_MAX;
+				src->restart_at = _now() + src->backoff;
+				return(_silence(src, buf, frames));
+			}
+		}
+		
+		/* Read whatever is waiting, after any partial frame left over */
+		memcpy(buf, src->partial, src->carry);
+		r = read(src->fd, buf + src->carry, frames * src->frame_size - src->carry);
+		
+		if(r > 0)
+		{
+			src->last_read = _now();
+			src->silent_at = 0;
+			
+			r += src->carry;
+			n = r / src->frame_size;
+			
+			/* Keep any partial frame for the next read */
+			src->carry = r - n * src->frame_size;
+			memcpy(src->partial, buf + n * src->frame_size, src->carry);
+			
+			if(n > 0) return(n);
+			continue;
+		}
+		
+		if(r < 0 && errno == EINTR) continue;
+		
+		if(r < 0 && errno == EAGAIN)
+		{
+			/* Nothing yet, unless the command has stalled */
+			t = _now() - src->last_read;
+			
+			if(src->stall <= 0 || t < src->stall)
+			{
+				return(0);
+			}
+			
+			if(src->silent_at == 0 && src->stalls++ == 0)
+			{
+				/* Don't hold up the multiplex */
+				fprintf(stderr, "Warning: '%s' has stalled, playing silence\n", src->argv[src->argv[1] && strcmp(src->argv[1], "-c") == 0 ? 2 : 0]);
+			}
+			
+			if(src->stall_restart > 0 && t - src->stall >= src->stall_restart)
+			{
+				/* Stalled for too long, stop it and start again */
+				fprintf(stderr, "Warning: '%s' has stalled for %g seconds, restarting\n", src->argv[src->argv[1] && strcmp(src->argv[1], "-c") == 0 ? 2 : 0], src->stall_restart);
+				_restart(src);
+			}
+			
+			return(_silence(src, buf, frames));
+		}
+		
+		/* End of output, the command has exited */
+		if(!src->repeat && src->stall <= 0)
+		{
+			_reap(src);
+			return(-1);
+		}
+		
+		_restart(src);
+	}
+}
+
+static int _src_rawaudio_read_exec(src_rawaudio_t *src, int16_t *audio[2], int audio_step[2])
+{
+	int i;
+	
+	i = _read_pipe(src, (uint8_t *) src->audio, src->audio_len);
+	
+	_map_audio(src, src->audio, audio, audio_step);
+	
 	return(i);
 }
 
+static void _convert(src_rawaudio_t *src, const uint8_t *p, int frames)
+{
+	int16_t *dst;
+	const uint8_t *s;
+	uint16_t u;
+	float f;
+	int c, i;
+	
+	/* Only the first two channels of the input are used */
+	for(c = 0; c < src->channels && c < 2; c++)
+	{
+		dst = src->conv[c];
+		s = p + c * (src->frame_size / src->channels);
+		
+		switch(src->format)
+		{
+		case _S16:
+			for(i = 0; i < frames; i++, s += src->frame_size)
+			{
+				memcpy(&dst[i], s, sizeof(int16_t));
+			}
+			break;
+		
+		case _S16_SWAP:
+			for(i = 0; i < frames; i++, s += src->frame_size)
+			{
+				memcpy(&u, s, sizeof(uint16_t));
+				dst[i] = (int16_t) ((u >> 8) | (u << 8));
+			}
+			break;
+		
+		case _S24LE:
+			/* Keep the top 16 bits */
+			for(i = 0; i < frames; i++, s += src->frame_size)
+			{
+				dst[i] = (int16_t) (s[1] | (s[2] << 8));
+			}
+			break;
+		
+		case _S24BE:
+			for(i = 0; i < frames; i++, s += src->frame_size)
+			{
+				dst[i] = (int16_t) ((s[0] << 8) | s[1]);
+			}
+			break;
+		
+		case _F32:
+			for(i = 0; i < frames; i++, s += src->frame_size)
+			{
+				memcpy(&f, s, sizeof(float));
+				f *= 32767.0f;
+				if(f > INT16_MAX) f = INT16_MAX;
+				else if(f < INT16_MIN) f = INT16_MIN;
+				dst[i] = lrintf(f);
+			}
+			break;
+		}
+	}
+	
+	src->conv_n = frames;
+	src->conv_pos = 0;
+}
+
+static int _fetch(src_rawaudio_t *src)
+{
+	uint8_t *p;
+	size_t n;
+	int r;
+	
+	/* Read and convert the next chunk of the input */
+	if(src->map)
+	{
+		if(src->pos == src->frames)
+		{
+			if(src->repeat) src->pos = 0;
+			else return(-1);
+		}
+		
+		n = _next_map(src, &p, CONVERT_CHUNK);
+	}
+	else if(src->exec)
+	{
+		p = src->raw;
+		r = _read_pipe(src, p, CONVERT_CHUNK);
+		if(r < 0) return(-1);
+		n = r;
+	}
+	else
+	{
+		if(feof(src->f))
+		{
+			if(src->repeat) fseek(src->f, 0, SEEK_SET);
+			else return(-1);
+		}
+		
+		p = src->raw;
+		n = fread(p, src->frame_size, CONVERT_CHUNK, src->f);
+	}
+	
+	_convert(src, p, n);
+	
+	return(n);
+}
+
+static int _src_rawaudio_read_convert(src_rawaudio_t *src, int16_t *audio[2], int audio_step[2])
+{
+	int16_t *out[2];
+	int step[2] = { 1, 1 };
+	int r;
+	
+	if(!src->resample)
+	{
+		/* Already at the right rate, return the converted audio */
+		if(_fetch(src) < 0) return(-1);
+		_map_conv(src, audio, audio_step);
+		return(src->conv_n);
+	}
+	
+	while(1)
+	{
+		/* Resampler output goes to the audio buffer */
+		out[0] = src->audio;
+		out[1] = src->audio + src->audio_len;
+		
+		r = resample_read(&src->rs, out, step, src->audio_len);
+		if(r > 0)
+		{
+			audio[0] = out[0];
+			audio[1] = out[src->rs.channels == 1 ? 0 : 1];
+			audio_step[0] = audio_step[1] = 1;
+			return(r);
+		}
+		
+		if(src->conv_pos == src->conv_n)
+		{
+			/* Return early if the input has nothing ready yet */
+			r = _fetch(src);
+			if(r <= 0) return(r);
+		}
+		
+		_map_conv(src, out, step);
+		src->conv_pos += resample_write(&src->rs, out, step, src->conv_n - src->conv_pos);
+	}
+}
+
 static int _src_rawaudio_close(src_rawaudio_t *src)
 {
-	if(src->exec) pclose(src->f);
-	else fclose(src->f);
+	if(src->map) munmap(src->map, src->map_size);
+	if(src->f) fclose(src->f);
+	
+	if(src->exec)
+	{
+		_reap(src);
+		
+		if(src->stalls > 0 || src->restarts > 0)
+		{
+			fprintf(stderr, "Command stalled %lu times, restarted %lu times\n", src->stalls, src->restarts);
+		}
+	}
+	
+	free(src->argv);
+	free(src->partial);
+	if(src->resample) resample_free(&src->rs);
+	free(src->conv[0]);
+	free(src->raw);
 	free(src->audio);
 	free(src);
 	return(0);
 }
 
-int src_rawaudio_open(src_t *s, const char *filename, int exec, int stereo, int repeat)
+static int _map_file(src_rawaudio_t *src)
+{
+	struct stat st;
+	size_t l;
+	int fd = fileno(src->f);
+	
+	/* Only regular, non-empty files can be mapped. Anything
+	 * else falls back to being read through stdio */
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		return(-1);
+	}
+	
+	src->map_size = st.st_size;
+	src->frames = src->map_size / src->frame_size;
+	if(src->frames == 0) return(-1);
+	
+	src->map = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(src->map == MAP_FAILED)
+	{
+		src->map = NULL;
+		return(-1);
+	}
+	
+	madvise(src->map, src->map_size, MADV_SEQUENTIAL);
+	
+	/* Hint the first chunk is needed now */
+	l = MAP_CHUNK * src->frame_size;
+	madvise(src->map, src->map_size < l ? src->map_size : l, MADV_WILLNEED);
+	
+	return(0);
+}
+
+static int _init_convert(src_rawaudio_t *src, int rate)
+{
+	int channels = src->channels < 2 ? 1 : 2;
+	
+	src->conv[0] = malloc(sizeof(int16_t) * CONVERT_CHUNK * 2);
+	src->conv[1] = src->conv[0] + CONVERT_CHUNK;
+	if(!src->conv[0]) return(-1);
+	
+	if(!src->map)
+	{
+		src->raw = malloc(src->frame_size * CONVERT_CHUNK);
+		if(!src->raw) return(-1);
+	}
+	
+	if(rate != SRC_SAMPLE_RATE)
+	{
+		if(resample_init(&src->rs, channels, (double) rate / SRC_SAMPLE_RATE) != 0)
+		{
+			return(-1);
+		}
+		
+		src->resample = 1;
+		
+		/* Output buffer for the resampler, two planes */
+		src->audio_len = CONVERT_CHUNK;
+		src->audio = malloc(sizeof(int16_t) * src->audio_len * 2);
+		if(!src->audio) return(-1);
+	}
+	
+	return(0);
+}
+
+int src_rawaudio_open(src_t *s, const char *filename, int exec, int channels, int repeat, int rate, const char *format, double stall, double stall_restart)
 {
 	src_rawaudio_t *src;
+	int i;
 	
 	memset(s, 0, sizeof(src_t));
 	
+	for(i = 0; _formats[i].name && strcasecmp(_formats[i].name, format) != 0; i++);
+	if(!_formats[i].name)
+	{
+		fprintf(stderr, "Unrecognised audio format '%s'\n", format);
+		return(-1);
+	}
+	
+	if(channels < 1 || rate <= 0)
+	{
+		fprintf(stderr, "Invalid channel count or sample rate\n");
+		return(-1);
+	}
+	
 	src = calloc(1, sizeof(src_rawaudio_t));
 	if(!src)
 	{
@@ -85,30 +746,86 @@ int src_rawaudio_open(src_t *s, const char *filename, int exec, int stereo, int
 	}
 	
 	src->exec = exec;
-	src->f = (src->exec ? popen(filename, "r") : fopen(filename, "rb"));
-	if(!src->f)
+	src->channels = channels;
+	src->repeat = repeat;
+	src->rate = rate;
+	src->format = _formats[i].format;
+	src->frame_size = _formats[i].bytes * channels;
+	
+	if(src->exec)
 	{
-		perror(filename);
-		free(src);
-		return(-1);
+		src->fd = -1;
+		src->stall = stall;
+		src->stall_restart = stall_restart;
+		src->backoff = RESTART_MIN;
+		src->argv = _split_args(filename);
+		src->partial = malloc(src->frame_size);
+		
+		if(src->argv && src->argv[0] == NULL)
+		{
+			fprintf(stderr, "No command given\n");
+			_src_rawaudio_close(src);
+			return(-1);
+		}
+		
+		if(!src->argv || !src->partial || _spawn(src) != 0)
+		{
+			_src_rawaudio_close(src);
+			return(-1);
+		}
+	}
+	else
+	{
+		src->f = fopen(filename, "rb");
+		if(!src->f)
+		{
+			perror(filename);
+			free(src);
+			return(-1);
+		}
+		
+		_map_file(src);
+	}
+	
+	if(src->format != _S16 || channels > 2 || rate != SRC_SAMPLE_RATE)
+	{
+		/* The input needs converting to 32 kHz 16-bit */
+		if(_init_convert(src, rate) != 0)
+		{
+			_src_rawaudio_close(src);
+			return(-1);
+		}
+		
+		/* Register the callback functions */
+		s->private = src;
+		s->read = (src_read_t) _src_rawaudio_read_convert;
+		s->close = (src_close_t) _src_rawaudio_close;
+		
+		return(0);
+	}
+	
+	if(src->map)
+	{
+		/* Register the callback functions */
+		s->private = src;
+		s->read = (src_read_t) _src_rawaudio_read_map;
+		s->close = (src_close_t) _src_rawaudio_close;
+		
+		return(0);
 	}
-	src->channels = stereo ? 2 : 1;
-	src->repeat = repeat;
 	
 	/* Allocate memory for output buffer (0.1 seconds) */
 	src->audio_len = SRC_SAMPLE_RATE * 0.1;
 	src->audio = malloc(src->audio_len * sizeof(int16_t) * src->channels);
 	if(!src->audio)
 	{
-		if(src->exec) pclose(src->f);
-		else fclose(src->f);
-		free(src);
+		_src_rawaudio_close(src);
 		return(-1);
 	}
 	
 	/* Register the callback functions */
 	s->private = src;
-	s->read = (src_read_t) _src_rawaudio_read;
+	s->read = (src_read_t) (src->exec ? _src_rawaudio_read_exec : _src_rawaudio_read);
 	s->close = (src_close_t) _src_rawaudio_close;
 	
 	return(0);
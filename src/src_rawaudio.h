@@ -18,7 +18,17 @@
 #ifndef _SRC_RAWAUDIO_H
 #define _SRC_RAWAUDIO_H
 
-extern int src_rawaudio_open(src_t *s, const char *filename, int exec, int stereo, int repeat);
+/* Raw interleaved PCM. Formats are s16 (native), s16le, s16be, s24le,
+ * s24be and f32. Inputs not in native 16-bit at 32 kHz are converted
+ * and resampled. Only the first two channels are used.
+ * 
+ * With exec the filename is a command to run, reading its output. If
+ * stall is non-zero the source plays silence whenever the command has
+ * written nothing for that many seconds, and restarts the command if it
+ * exits. A command that stays stalled for stall_restart seconds is
+ * stopped and restarted the same way, unless that is zero. Otherwise
+ * the source waits, and only restarts with repeat */
+extern int src_rawaudio_open(src_t *s, const char *filename, int exec, int channels, int repeat, int rate, const char *format, double stall, double stall_restart);
 
 #endif
 
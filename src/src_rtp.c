@@ -0,0 +1,555 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "src.h"
+#include "resample.h"
+
+/* Packets held by the jitter buffer, must be a power of two */
+#define SLOTS 256
+
+/* Largest RTP payload accepted */
+#define MAX_PAYLOAD 1500
+
+/* Packets received per recvmmsg() call */
+#define BATCH 32
+
+/* How long a read waits for the next packet before playing
+ * silence, and the receive timeout of the socket (100ms) */
+#define STALL_NS 100000000L
+
+typedef struct {
+	uint16_t seq;
+	int valid;
+	int len;
+	uint8_t data[MAX_PAYLOAD];
+} _slot_t;
+
+typedef struct {
+	
+	int sock;
+	pthread_t thread;
+	volatile int quit;
+	
+	/* Payload format */
+	int bytes;
+	int channels;
+	int rate;
+	
+	/* Jitter buffer, shared with the receiver thread */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	_slot_t *slots;
+	int started;
+	int primed;
+	uint16_t play;
+	uint16_t newest;
+	double jitter;
+	int depth;
+	
+	/* Statistics */
+	unsigned long lost;
+	unsigned long late;
+	
+	/* Decoded audio of the current packet, planar */
+	int16_t *conv[2];
+	int conv_len;
+	int conv_n;
+	int conv_pos;
+	int concealed;
+	
+	/* Resampler when not at the DSR sample rate */
+	int resample;
+	resample_t rs;
+	int16_t *out[2];
+	
+} src_rtp_t;
+
+static void _timeout(struct timespec *ts, long ns)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	
+	ts->tv_nsec += ns;
+	if(ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void _reset(src_rtp_t *src, uint16_t seq)
+{
+	int i;
+	
+	/* Drop everything buffered and start again from seq */
+	for(i = 0; i < SLOTS; i++)
+	{
+		src->slots[i].valid = 0;
+	}
+	
+	src->started = 1;
+	src->primed = 0;
+	src->play = seq;
+	src->newest = seq;
+}
+
+static void _packet(src_rtp_t *src, const uint8_t *p, int len)
+{
+	_slot_t *slot;
+	uint16_t seq;
+	int hlen, d;
+	
+	/* Parse the RTP header (RFC 3550) */
+	if(len < 12 || (p[0] >> 6) != 2) return;
+	
+	hlen = 12 + (p[0] & 0x0F) * 4;
+	seq = (p[2] << 8) | p[3];
+	
+	if(p[0] & 0x10)
+	{
+		/* Skip the header extension */
+		if(len < hlen + 4) return;
+		hlen += 4 + ((p[hlen + 2] << 8) | p[hlen + 3]) * 4;
+	}
+	
+	if(p[0] & 0x20)
+	{
+		/* Remove padding */
+		len -= p[len - 1];
+	}
+	
+	len -= hlen;
+	if(len <= 0 || len > MAX_PAYLOAD) return;
+	
+	/* Drop any incomplete frame */
+	len -= len % (src->bytes * src->channels);
+	if(len == 0) return;
+	
+	pthread_mutex_lock(&src->mutex);
+	
+	d = (int16_t) (seq - src->play);
+	
+	if(!src->started || d >= SLOTS || d <= -SLOTS)
+	{
+		/* First packet, or the stream has jumped */
+		_reset(src, seq);
+	}
+	else if(d < 0)
+	{
+		/* Already played or concealed */
+		src->late++;
+		pthread_mutex_unlock(&src->mutex);
+		return;
+	}
+	
+	slot = &src->slots[seq & (SLOTS - 1)];
+	slot->seq = seq;
+	slot->len = len;
+	slot->valid = 1;
+	memcpy(slot->data, p + hlen, len);
+	
+	if((int16_t) (seq - src->newest) > 0)
+	{
+		src->newest = seq;
+	}
+	
+	if(src->depth == 0)
+	{
+		/* Size the buffer from the first packet's length */
+		src->depth = src->jitter * src->rate / (len / (src->bytes * src->channels)) + 1;
+		if(src->depth >= SLOTS / 2) src->depth = SLOTS / 2;
+	}
+	
+	pthread_cond_signal(&src->cond);
+	pthread_mutex_unlock(&src->mutex);
+}
+
+static void *_receiver(void *arg)
+{
+	src_rtp_t *src = arg;
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov[BATCH];
+	uint8_t *buf;
+	int i, r;
+	
+	buf = malloc(BATCH * (MAX_PAYLOAD + 64));
+	if(!buf)
+	{
+		perror("malloc");
+		return(NULL);
+	}
+	
+	memset(msgs, 0, sizeof(msgs));
+	
+	for(i = 0; i < BATCH; i++)
+	{
+		iov[i].iov_base = buf + i * (MAX_PAYLOAD + 64);
+		iov[i].iov_len = MAX_PAYLOAD + 64;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	while(!src->quit)
+	{
+		/* Collect as many packets as are waiting in one call */
+		r = recvmmsg(src->sock, msgs, BATCH, MSG_WAITFORONE, NULL);
+		
+		if(r < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+			perror("recvmmsg");
+			break;
+		}
+		
+		for(i = 0; i < r; i++)
+		{
+			_packet(src, iov[i].iov_base, msgs[i].msg_len);
+		}
+	}
+	
+	free(buf);
+	
+	return(NULL);
+}
+
+static void _decode(src_rtp_t *src, const _slot_t *slot)
+{
+	const uint8_t *s;
+	int c, i, stride;
+	
+	/* Samples are big-endian, keep the top 16 bits */
+	stride = src->bytes * src->channels;
+	src->conv_n = slot->len / stride;
+	src->conv_pos = 0;
+	
+	for(c = 0; c < src->channels && c < 2; c++)
+	{
+		s = slot->data + c * src->bytes;
+		
+		for(i = 0; i < src->conv_n; i++, s += stride)
+		{
+			src->conv[c][i] = (int16_t) ((s[0] << 8) | s[1]);
+		}
+	}
+}
+
+static void _conceal(src_rtp_t *src)
+{
+	int c, i;
+	
+	/* Repeat the last packet once fading out, then silence */
+	for(c = 0; c < 2; c++)
+	{
+		for(i = 0; i < src->conv_n; i++)
+		{
+			src->conv[c][i] = src->concealed ? 0 : src->conv[c][i] * (src->conv_n - i) / src->conv_n;
+		}
+	}
+	
+	src->concealed = 1;
+	src->conv_pos = 0;
+}
+
+static void _next(src_rtp_t *src)
+{
+	_slot_t *slot;
+	struct timespec ts;
+	
+	pthread_mutex_lock(&src->mutex);
+	
+	while(1)
+	{
+		if(src->primed)
+		{
+			slot = &src->slots[src->play & (SLOTS - 1)];
+			
+			if(slot->valid && slot->seq == src->play)
+			{
+				/* The next packet is here */
+				_decode(src, slot);
+				slot->valid = 0;
+				src->concealed = 0;
+				src->play++;
+				break;
+			}
+			
+			if((int16_t) (src->newest - src->play) >= src->depth)
+			{
+				/* Waited long enough, treat it as lost */
+				_conceal(src);
+				src->lost++;
+				src->play++;
+				break;
+			}
+		}
+		else if(src->started && (int16_t) (src->newest - src->play) >= src->depth)
+		{
+			/* Buffered enough to start playing */
+			src->primed = 1;
+			continue;
+		}
+		
+		_timeout(&ts, STALL_NS);
+		
+		if(pthread_cond_timedwait(&src->cond, &src->mutex, &ts) == ETIMEDOUT)
+		{
+			/* The stream has stalled, play silence in real time
+			 * and buffer up again before restarting */
+			src->concealed = 1;
+			src->conv_n = src->rate / 10;
+			_conceal(src);
+			
+			src->primed = 0;
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&src->mutex);
+}
+
+static int _src_rtp_read(src_rtp_t *src, int16_t *audio[2], int audio_step[2])
+{
+	int16_t *in[2];
+	int step[2] = { 1, 1 };
+	int r;
+	
+	if(!src->resample)
+	{
+		_next(src);
+		audio[0] = src->conv[0];
+		audio[1] = src->conv[src->channels == 1 ? 0 : 1];
+		audio_step[0] = audio_step[1] = 1;
+		return(src->conv_n);
+	}
+	
+	while(1)
+	{
+		r = resample_read(&src->rs, src->out, step, src->conv_len);
+		if(r > 0)
+		{
+			audio[0] = src->out[0];
+			audio[1] = src->out[src->rs.channels == 1 ? 0 : 1];
+			audio_step[0] = audio_step[1] = 1;
+			return(r);
+		}
+		
+		if(src->conv_pos == src->conv_n)
+		{
+			_next(src);
+		}
+		
+		in[0] = src->conv[0] + src->conv_pos;
+		in[1] = src->conv[1] + src->conv_pos;
+		src->conv_pos += resample_write(&src->rs, in, step, src->conv_n - src->conv_pos);
+	}
+}
+
+static int _src_rtp_close(src_rtp_t *src)
+{
+	if(src->thread)
+	{
+		src->quit = 1;
+		pthread_join(src->thread, NULL);
+		
+		fprintf(stderr, "RTP: %lu packets lost, %lu late\n", src->lost, src->late);
+	}
+	
+	if(src->sock >= 0) close(src->sock);
+	if(src->resample) resample_free(&src->rs);
+	pthread_cond_destroy(&src->cond);
+	pthread_mutex_destroy(&src->mutex);
+	free(src->slots);
+	free(src->conv[0]);
+	free(src->out[0]);
+	free(src);
+	
+	return(0);
+}
+
+static int _open_socket(const char *address, const char *port)
+{
+	struct addrinfo hints, *ai;
+	struct ip_mreq mreq;
+	struct ipv6_mreq mreq6;
+	struct timeval tv;
+	int sock, r, one = 1;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+	
+	r = getaddrinfo(address, port, &hints, &ai);
+	if(r != 0)
+	{
+		fprintf(stderr, "%s: %s\n", address ? address : "", gai_strerror(r));
+		return(-1);
+	}
+	
+	sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+	if(sock < 0)
+	{
+		perror("socket");
+		freeaddrinfo(ai);
+		return(-1);
+	}
+	
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	
+	/* Wake the receiver now and then to check for shutdown */
+	tv.tv_sec = 0;
+	tv.tv_usec = STALL_NS / 1000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	
+	if(bind(sock, ai->ai_addr, ai->ai_addrlen) != 0)
+	{
+		perror("bind");
+		close(sock);
+		freeaddrinfo(ai);
+		return(-1);
+	}
+	
+	/* Join the group if this is a multicast address */
+	r = 0;
+	
+	if(ai->ai_family == AF_INET &&
+	   IN_MULTICAST(ntohl(((struct sockaddr_in *) ai->ai_addr)->sin_addr.s_addr)))
+	{
+		mreq.imr_multiaddr = ((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+		r = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+	}
+	else if(ai->ai_family == AF_INET6 &&
+	        IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr))
+	{
+		mreq6.ipv6mr_multiaddr = ((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+		mreq6.ipv6mr_interface = 0;
+		r = setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6, sizeof(mreq6));
+	}
+	
+	freeaddrinfo(ai);
+	
+	if(r != 0)
+	{
+		perror("Multicast join");
+		close(sock);
+		return(-1);
+	}
+	
+	return(sock);
+}
+
+int src_rtp_open(src_t *s, const char *address, const char *port, const char *format, int channels, int rate, double jitter)
+{
+	src_rtp_t *src;
+	
+	memset(s, 0, sizeof(src_t));
+	
+	if(channels < 1 || rate <= 0)
+	{
+		fprintf(stderr, "Invalid channel count or sample rate\n");
+		return(-1);
+	}
+	
+	src = calloc(1, sizeof(src_rtp_t));
+	if(!src)
+	{
+		return(-1);
+	}
+	
+	src->sock = -1;
+	src->channels = channels;
+	src->rate = rate;
+	src->jitter = jitter;
+	pthread_mutex_init(&src->mutex, NULL);
+	pthread_cond_init(&src->cond, NULL);
+	
+	if(strcasecmp(format, "L16") == 0) src->bytes = 2;
+	else if(strcasecmp(format, "L24") == 0) src->bytes = 3;
+	else
+	{
+		fprintf(stderr, "Unrecognised RTP payload format '%s'\n", format);
+		_src_rtp_close(src);
+		return(-1);
+	}
+	
+	/* Decoded audio, large enough for the biggest packet or
+	 * the silence played when the stream stalls */
+	src->conv_len = MAX_PAYLOAD / src->bytes;
+	if(src->conv_len < rate / 10) src->conv_len = rate / 10;
+	
+	src->slots = calloc(SLOTS, sizeof(_slot_t));
+	src->conv[0] = calloc(src->conv_len * 2, sizeof(int16_t));
+	src->conv[1] = src->conv[0] + src->conv_len;
+	
+	if(!src->slots || !src->conv[0])
+	{
+		_src_rtp_close(src);
+		return(-1);
+	}
+	
+	if(rate != SRC_SAMPLE_RATE)
+	{
+		src->out[0] = malloc(sizeof(int16_t) * src->conv_len * 2);
+		src->out[1] = src->out[0] + src->conv_len;
+		
+		if(!src->out[0] ||
+		   resample_init(&src->rs, channels < 2 ? 1 : 2, (double) rate / SRC_SAMPLE_RATE) != 0)
+		{
+			_src_rtp_close(src);
+			return(-1);
+		}
+		
+		src->resample = 1;
+	}
+	
+	src->sock = _open_socket(address, port);
+	if(src->sock < 0)
+	{
+		_src_rtp_close(src);
+		return(-1);
+	}
+	
+	if(pthread_create(&src->thread, NULL, _receiver, src) != 0)
+	{
+		perror("pthread_create");
+		src->thread = 0;
+		_src_rtp_close(src);
+		return(-1);
+	}
+	
+	/* Register the callback functions */
+	s->private = src;
+	s->read = (src_read_t) _src_rtp_read;
+	s->close = (src_close_t) _src_rtp_close;
+	
+	return(0);
+}
+
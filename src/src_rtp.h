@@ -0,0 +1,33 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _SRC_RTP_H
+#define _SRC_RTP_H
+
+/* Receives L16 or L24 PCM over RTP (RFC 3551) on a unicast or multicast
+ * address. Packets are collected by a receiver thread into a jitter
+ * buffer of jitter seconds, reordered by sequence number, and any that
+ * do not arrive in time are concealed. If the stream stops the source
+ * plays silence until it returns.
+ * 
+ * The sender runs on its own clock, use adaptive on live outputs.
+*/
+
+extern int src_rtp_open(src_t *s, const char *address, const char *port, const char *format, int channels, int rate, double jitter);
+
+#endif
+
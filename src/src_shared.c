@@ -0,0 +1,292 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "src.h"
+
+/* Samples decoded into the ring at a time (20ms) */
+#define CHUNK (SRC_SAMPLE_RATE / 50)
+
+typedef struct _shared_t {
+	
+	struct _shared_t *next;
+	char *key;
+	int refs;
+	
+	/* Held while updating the ring. The source is decoded
+	 * outside of it, by one reader at a time */
+	pthread_mutex_t mutex;
+	src_t src;
+	int decoding;
+	
+	/* Planar stereo ring, head counts every sample ever written */
+	int16_t *ring[2];
+	unsigned int len;
+	uint64_t head;
+	int eof;
+	
+} _shared_t;
+
+typedef struct {
+	_shared_t *sh;
+	uint64_t pos;
+	
+	/* The run last returned, copied out of the ring */
+	int16_t buf[2][CHUNK];
+} src_shared_t;
+
+/* Registry of open shared sources */
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static _shared_t *_shared = NULL;
+
+static int _src_shared_read(src_shared_t *src, int16_t *audio[2], int audio_step[2])
+{
+	_shared_t *sh = src->sh;
+	unsigned int x, n;
+	int r;
+	
+	pthread_mutex_lock(&sh->mutex);
+	
+	if(src->pos == sh->head)
+	{
+		if(sh->eof)
+		{
+			pthread_mutex_unlock(&sh->mutex);
+			return(-1);
+		}
+		
+		if(sh->decoding)
+		{
+			/* Another reader is decoding the next chunk, rather
+			 * than wait on it come back for the audio later */
+			pthread_mutex_unlock(&sh->mutex);
+			return(0);
+		}
+		
+		/* This reader is in front, decode the next chunk. The skip
+		 * below keeps every other reader clear of this part of the
+		 * ring, so the lock is released while the source is read */
+		x = sh->head & (sh->len - 1);
+		n = sh->len - x;
+		if(n > CHUNK) n = CHUNK;
+		
+		sh->decoding = 1;
+		pthread_mutex_unlock(&sh->mutex);
+		
+		r = src_read_block(&sh->src, &sh->ring[0][x], &sh->ring[1][x], n);
+		
+		pthread_mutex_lock(&sh->mutex);
+		sh->decoding = 0;
+		sh->head += r;
+		
+		if(r < n && src_eof(&sh->src)) sh->eof = 1;
+		
+		if(r == 0)
+		{
+			pthread_mutex_unlock(&sh->mutex);
+			return(sh->eof ? -1 : 0);
+		}
+	}
+	
+	/* A reader that has fallen too far behind skips ahead, leaving
+	 * two chunks of slack before the front reader catches it again */
+	if(sh->head - src->pos > sh->len - CHUNK * 2)
+	{
+		src->pos = sh->head - (sh->len - CHUNK * 2);
+	}
+	
+	x = src->pos & (sh->len - 1);
+	n = sh->head - src->pos;
+	if(n > sh->len - x) n = sh->len - x;
+	if(n > CHUNK) n = CHUNK;
+	
+	/* Copy the run while the lock is held, the front reader
+	 * may overwrite the ring as soon as it is released */
+	memcpy(src->buf[0], &sh->ring[0][x], sizeof(int16_t) * n);
+	memcpy(src->buf[1], &sh->ring[1][x], sizeof(int16_t) * n);
+	
+	pthread_mutex_unlock(&sh->mutex);
+	
+	audio[0] = src->buf[0];
+	audio[1] = src->buf[1];
+	audio_step[0] = audio_step[1] = 1;
+	
+	src->pos += n;
+	
+	return(n);
+}
+
+static int _src_shared_close(src_shared_t *src)
+{
+	_shared_t *sh = src->sh, **p;
+	
+	pthread_mutex_lock(&_mutex);
+	
+	if(--sh->refs > 0)
+	{
+		pthread_mutex_unlock(&_mutex);
+		free(src);
+		return(0);
+	}
+	
+	/* That was the last reader, remove from the registry */
+	for(p = &_shared; *p; p = &(*p)->next)
+	{
+		if(*p == sh)
+		{
+			*p = sh->next;
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&_mutex);
+	
+	src_close(&sh->src);
+	pthread_mutex_destroy(&sh->mutex);
+	free(sh->ring[0]);
+	free(sh->key);
+	free(sh);
+	free(src);
+	
+	return(0);
+}
+
+static int _attach(src_t *s, _shared_t *sh)
+{
+	src_shared_t *src;
+	
+	src = calloc(1, sizeof(src_shared_t));
+	if(!src)
+	{
+		return(-1);
+	}
+	
+	/* Start from the oldest audio still safely in the ring */
+	src->sh = sh;
+	src->pos = sh->head > sh->len / 2 ? sh->head - sh->len / 2 : 0;
+	sh->refs++;
+	
+	/* Register the callback functions */
+	memset(s, 0, sizeof(src_t));
+	s->private = src;
+	s->read = (src_read_t) _src_shared_read;
+	s->close = (src_close_t) _src_shared_close;
+	s->period = sh->src.period;
+	
+	return(0);
+}
+
+int src_shared_attach(src_t *s, const char *key)
+{
+	_shared_t *sh;
+	int r = -1;
+	
+	pthread_mutex_lock(&_mutex);
+	
+	for(sh = _shared; sh; sh = sh->next)
+	{
+		if(strcmp(sh->key, key) == 0)
+		{
+			pthread_mutex_lock(&sh->mutex);
+			r = _attach(s, sh);
+			pthread_mutex_unlock(&sh->mutex);
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&_mutex);
+	
+	return(r);
+}
+
+int src_shared_open(src_t *s, const char *key, src_t *src, int samples)
+{
+	_shared_t *sh, *p;
+	int r;
+	
+	sh = calloc(1, sizeof(_shared_t));
+	if(!sh)
+	{
+		return(-1);
+	}
+	
+	/* The ring length must be a power of two */
+	if(samples < CHUNK * 4) samples = CHUNK * 4;
+	for(sh->len = 1; sh->len < samples; sh->len <<= 1);
+	
+	sh->ring[0] = malloc(sizeof(int16_t) * 2 * sh->len);
+	sh->ring[1] = sh->ring[0] + sh->len;
+	sh->key = strdup(key);
+	
+	if(!sh->ring[0] || !sh->key)
+	{
+		free(sh->ring[0]);
+		free(sh->key);
+		free(sh);
+		return(-1);
+	}
+	
+	pthread_mutex_init(&sh->mutex, NULL);
+	sh->src = *src;
+	
+	pthread_mutex_lock(&_mutex);
+	
+	/* Sources can be opened in parallel. If another channel has
+	 * registered the same source in the meantime, use that one */
+	for(p = _shared; p; p = p->next)
+	{
+		if(strcmp(p->key, key) == 0) break;
+	}
+	
+	if(p)
+	{
+		pthread_mutex_lock(&p->mutex);
+		r = _attach(s, p);
+		pthread_mutex_unlock(&p->mutex);
+		
+		/* The caller still owns src if this fails */
+		if(r == 0) src_close(src);
+	}
+	else
+	{
+		r = _attach(s, sh);
+		
+		if(r == 0)
+		{
+			/* Add to the registry */
+			sh->next = _shared;
+			_shared = sh;
+			sh = NULL;
+		}
+	}
+	
+	pthread_mutex_unlock(&_mutex);
+	
+	if(sh)
+	{
+		pthread_mutex_destroy(&sh->mutex);
+		free(sh->ring[0]);
+		free(sh->key);
+		free(sh);
+	}
+	
+	return(r);
+}
+
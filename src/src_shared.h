@@ -0,0 +1,35 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _SRC_SHARED_H
+#define _SRC_SHARED_H
+
+/* Shared sources are registered under a key describing their
+ * configuration. Every source opened with the same key reads from a
+ * single decoder through a common ring, each with its own read position.
+ * 
+ * src_shared_attach() returns -1 if no source is registered with the key,
+ * in which case the caller opens one and hands it to src_shared_open().
+ * The ring must be long enough to cover the furthest any one reader can
+ * get ahead of the others.
+*/
+
+extern int src_shared_attach(src_t *s, const char *key);
+extern int src_shared_open(src_t *s, const char *key, src_t *src, int samples);
+
+#endif
+
@@ -0,0 +1,214 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "src.h"
+
+#define BLOCK_LEN (SRC_SHM_BLOCK * SRC_SHM_CHANNELS)
+
+void src_shm_release(src_shm_t *s)
+{
+	/* Hand the oldest block in use back to the producer */
+	atomic_fetch_add_explicit(&s->shm->tail, 1, memory_order_release);
+}
+
+int src_shm_eof(src_shm_t *s)
+{
+	/* The producer has finished and every block has been read */
+	return(atomic_load_explicit(&s->shm->eof, memory_order_acquire) &&
+	       atomic_load_explicit(&s->shm->head, memory_order_acquire) == s->next);
+}
+
+int16_t *src_shm_read(src_shm_t *s, int16_t *audio)
+{
+	src_shm_header_t *shm = s->shm;
+	struct timespec ts = { 0, 1000000L };
+	const int16_t *src;
+	int c, x;
+	
+	while(atomic_load_explicit(&shm->head, memory_order_acquire) == s->next)
+	{
+		if(!s->blocking || atomic_load_explicit(&shm->eof, memory_order_acquire))
+		{
+			/* Nothing ready, play silence */
+			if(!atomic_load_explicit(&shm->eof, memory_order_relaxed))
+			{
+				s->underruns++;
+			}
+			
+			memset(audio, 0, sizeof(int16_t) * BLOCK_LEN);
+			return(audio);
+		}
+		
+		nanosleep(&ts, NULL);
+	}
+	
+	src = &s->data[(s->next & (shm->blocks - 1)) * BLOCK_LEN];
+	s->next++;
+	
+	if(shm->layout == SRC_SHM_PLANAR)
+	{
+		/* Already in the encoder's layout, use it in place. The
+		 * caller releases it once it has finished with it */
+		return((int16_t *) src);
+	}
+	
+	for(c = 0; c < SRC_SHM_CHANNELS; c++)
+	{
+		for(x = 0; x < SRC_SHM_BLOCK; x++)
+		{
+			audio[c * SRC_SHM_BLOCK + x] = src[x * SRC_SHM_CHANNELS + c];
+		}
+	}
+	
+	src_shm_release(s);
+	
+	return(audio);
+}
+
+void src_shm_close(src_shm_t *s)
+{
+	if(!s->shm) return;
+	
+	/* Release any blocks still held */
+	atomic_store_explicit(&s->shm->tail, s->next, memory_order_release);
+	
+	if(s->underruns > 0)
+	{
+		fprintf(stderr, "Shared memory source: %lu underruns\n", s->underruns);
+	}
+	
+	munmap(s->shm, sizeof(src_shm_header_t));
+	munmap(s->map, s->size);
+	memset(s, 0, sizeof(src_shm_t));
+}
+
+int src_shm_open(src_shm_t *s, const char *name, int layout, int blocks, int blocking)
+{
+	src_shm_header_t *shm;
+	struct stat st;
+	void *map;
+	int fd, create = 0;
+	size_t size;
+	
+	memset(s, 0, sizeof(src_shm_t));
+	s->blocking = blocking;
+	
+	/* Open the producer's ring, or create it if not there yet */
+	fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0 && errno == ENOENT)
+	{
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+		create = 1;
+	}
+	
+	if(fd < 0)
+	{
+		perror(name);
+		return(-1);
+	}
+	
+	if(create)
+	{
+		if(blocks < 2 || (blocks & (blocks - 1)) != 0)
+		{
+			fprintf(stderr, "%s: The number of blocks must be a power of two\n", name);
+			close(fd);
+			shm_unlink(name);
+			return(-1);
+		}
+		
+		size = sizeof(src_shm_header_t) + sizeof(int16_t) * BLOCK_LEN * blocks;
+		
+		if(ftruncate(fd, size) != 0)
+		{
+			perror(name);
+			close(fd);
+			shm_unlink(name);
+			return(-1);
+		}
+	}
+	else
+	{
+		if(fstat(fd, &st) != 0 || st.st_size < sizeof(src_shm_header_t))
+		{
+			fprintf(stderr, "%s: Invalid shared memory object\n", name);
+			close(fd);
+			return(-1);
+		}
+		
+		size = st.st_size;
+	}
+	
+	/* Only the header is mapped writable. The audio belongs
+	 * to the producer, and planar blocks are used in place */
+	shm = mmap(NULL, sizeof(src_shm_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	if(shm == MAP_FAILED || map == MAP_FAILED)
+	{
+		perror("mmap");
+		if(shm != MAP_FAILED) munmap(shm, sizeof(src_shm_header_t));
+		if(map != MAP_FAILED) munmap(map, size);
+		return(-1);
+	}
+	
+	if(create)
+	{
+		shm->layout = layout;
+		shm->channels = SRC_SHM_CHANNELS;
+		shm->blocks = blocks;
+		atomic_store(&shm->head, 0);
+		atomic_store(&shm->tail, 0);
+		atomic_store(&shm->eof, 0);
+		
+		/* Written last, the producer waits for this */
+		atomic_thread_fence(memory_order_release);
+		shm->magic = SRC_SHM_MAGIC;
+	}
+	else if(shm->magic != SRC_SHM_MAGIC ||
+	        shm->channels != SRC_SHM_CHANNELS ||
+	        shm->blocks < 2 ||
+	        (shm->blocks & (shm->blocks - 1)) != 0 ||
+	        shm->layout > SRC_SHM_INTERLEAVED ||
+	        size < sizeof(src_shm_header_t) + sizeof(int16_t) * BLOCK_LEN * shm->blocks)
+	{
+		fprintf(stderr, "%s: Unrecognised shared memory layout\n", name);
+		munmap(shm, sizeof(src_shm_header_t));
+		munmap(map, size);
+		return(-1);
+	}
+	
+	s->shm = shm;
+	s->data = ((const src_shm_header_t *) map)->data;
+	s->map = map;
+	s->size = size;
+	s->next = atomic_load(&shm->tail);
+	
+	return(0);
+}
+
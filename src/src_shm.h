@@ -0,0 +1,91 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _SRC_SHM_H
+#define _SRC_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* A POSIX shared memory ring carrying all 32 channels of the multiplex
+ * from an external producer, such as an audio router. The ring holds a
+ * power of two number of blocks of 64 samples for every channel, either
+ * channel-major as expected by dsr_encode() or interleaved (32 samples
+ * per frame). The producer advances head after writing a block and the
+ * consumer advances tail once it has finished with one. Setting eof
+ * tells the consumer no more blocks will follow.
+ * 
+ * src_shm_read() returns either audio, filled in, or a planar block
+ * still in the ring. The latter is mapped read-only, and must be handed
+ * back with src_shm_release() once encoded, in the order they were read.
+ * 
+ * If the object does not exist it is created and initialised, otherwise
+ * the layout and size are taken from the existing header.
+*/
+
+#define SRC_SHM_MAGIC       0x31525344 /* "DSR1" */
+#define SRC_SHM_CHANNELS    32
+#define SRC_SHM_BLOCK       64
+
+#define SRC_SHM_PLANAR      0
+#define SRC_SHM_INTERLEAVED 1
+
+typedef struct {
+	
+	uint32_t magic;
+	uint32_t layout;
+	uint32_t channels;
+	uint32_t blocks;
+	
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+	_Atomic uint32_t eof;
+	
+	uint8_t reserved[28];
+	
+	/* Followed by blocks * 64 * 32 samples */
+	int16_t data[];
+	
+} src_shm_header_t;
+
+typedef struct {
+	
+	/* The header, the only part written by the consumer, and
+	 * a read-only mapping of the whole object for the audio */
+	src_shm_header_t *shm;
+	const int16_t *data;
+	void *map;
+	size_t size;
+	
+	/* Index of the next block to read */
+	uint64_t next;
+	
+	/* Wait for the producer rather than play silence */
+	int blocking;
+	
+	unsigned long underruns;
+	
+} src_shm_t;
+
+extern int src_shm_open(src_shm_t *s, const char *name, int layout, int blocks, int blocking);
+extern int16_t *src_shm_read(src_shm_t *s, int16_t *audio);
+extern void src_shm_release(src_shm_t *s);
+extern int src_shm_eof(src_shm_t *s);
+extern void src_shm_close(src_shm_t *s);
+
+#endif
+
@@ -15,31 +15,284 @@
 /* You should have received a copy of the GNU General Public License     */
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
+#include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <pthread.h>
 #include "src.h"
 
+/* Size of the sine table used by the oscillators */
+#define SINE_BITS 12
+#define SINE_LEN  (1 << SINE_BITS)
+
+/* Periodic signals are rendered once into a cache if their
+ * period is no longer than this (10 seconds) */
+#define MAX_PERIOD (SRC_SAMPLE_RATE * 10)
+
+/* Minimum length of the cache, and the length of each block
+ * rendered for signals that are not cached */
+#define BLOCK 4096
+
+enum {
+	_SINE = 0,
+	_SWEEP,
+	_MULTITONE,
+	_NOISE,
+	_PINK,
+	_SILENCE,
+};
+
+static const char *_signals[] = {
+	"sine", "sweep", "multitone", "noise", "pink", "silence", NULL
+};
+
 typedef struct {
 	
 	int16_t *audio;
 	int audio_len;
 	
-	double x;
-	double delta;
+	int signal;
 	double level;
 	
+	/* Oscillators, 32-bit phase accumulators */
+	int tones;
+	uint32_t phase[SRC_TONE_MAX];
+	uint32_t delta[SRC_TONE_MAX];
+	double frequency[SRC_TONE_MAX];
+	
+	/* Sweep state */
+	double x;
+	double f0;
+	double f1;
+	long n;
+	long period;
+	
+	/* Noise state */
+	uint32_t rng;
+	float b[3];
+	
+	/* The buffer holds whole periods of the signal */
+	int cached;
+	
 } src_tone_t;
 
-static int _src_tone_read(src_tone_t *src, int16_t *audio[2], int audio_step[2])
+static float _sine[SINE_LEN + 1];
+static pthread_once_t _sine_once = PTHREAD_ONCE_INIT;
+
+static void _init_sine(void)
 {
 	int i;
 	
-	/* Render the tone */
-	for(i = 0; i < src->audio_len; i++)
+	for(i = 0; i <= SINE_LEN; i++)
+	{
+		_sine[i] = sin(2.0 * M_PI * i / SINE_LEN);
+	}
+}
+
+static inline float _nco(uint32_t phase)
+{
+	/* Table lookup with linear interpolation */
+	uint32_t i = phase >> (32 - SINE_BITS);
+	float f = (phase & ((1 << (32 - SINE_BITS)) - 1)) * (1.0f / (1 << (32 - SINE_BITS)));
+	
+	return(_sine[i] + (_sine[i + 1] - _sine[i]) * f);
+}
+
+static inline uint32_t _xorshift(uint32_t *s)
+{
+	uint32_t x = *s;
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	
+	return(*s = x);
+}
+
+static inline int16_t _clip(double v)
+{
+	if(v > INT16_MAX) return(INT16_MAX);
+	if(v < INT16_MIN) return(INT16_MIN);
+	return(v);
+}
+
+static void _render(src_tone_t *src, int16_t *dst, int samples)
+{
+	float amp, white, v;
+	double f;
+	int i, t;
+	
+	amp = src->level * INT16_MAX;
+	
+	switch(src->signal)
+	{
+	case _SINE:
+	case _MULTITONE:
+		/* Each tone takes an equal share of the level. The tones
+		 * are summed before clipping, the level can be over 1 */
+		amp /= src->tones;
+		
+		for(i = 0; i < samples; i++)
+		{
+			for(v = 0, t = 0; t < src->tones; t++)
+			{
+				v += _nco(src->phase[t] + src->delta[t] * i);
+			}
+			
+			dst[i] = _clip(v * amp);
+		}
+		
+		for(t = 0; t < src->tones; t++)
+		{
+			src->phase[t] += src->delta[t] * samples;
+		}
+		break;
+	
+	case _SWEEP:
+		/* Logarithmic sweep, starting again each period */
+		for(i = 0; i < samples; i++)
+		{
+			dst[i] = sin(src->x) * amp;
+			
+			f = src->f0 * pow(src->f1 / src->f0, (double) src->n / src->period);
+			src->x = fmod(src->x + 2.0 * M_PI * f / SRC_SAMPLE_RATE, 2.0 * M_PI);
+			
+			if(++src->n == src->period)
+			{
+				src->n = 0;
+				src->x = 0;
+			}
+		}
+		break;
+	
+	case _NOISE:
+		for(i = 0; i < samples; i++)
+		{
+			dst[i] = (int32_t) _xorshift(&src->rng) * (1.0f / 2147483648.0f) * amp;
+		}
+		break;
+	
+	case _PINK:
+		/* White noise through a three pole approximation of a 1/f
+		 * filter (Paul Kellet's economy method) */
+		for(i = 0; i < samples; i++)
+		{
+			white = (int32_t) _xorshift(&src->rng) * (1.0f / 2147483648.0f);
+			
+			src->b[0] = 0.99765f * src->b[0] + white * 0.0990460f;
+			src->b[1] = 0.96300f * src->b[1] + white * 0.2965164f;
+			src->b[2] = 0.57000f * src->b[2] + white * 1.0526913f;
+			
+			dst[i] = _clip((src->b[0] + src->b[1] + src->b[2] + white * 0.1848f) * 0.125f * amp);
+		}
+		break;
+	
+	case _SILENCE:
+		memset(dst, 0, sizeof(int16_t) * samples);
+		break;
+	}
+}
+
+static long _gcd(long a, long b)
+{
+	long t;
+	
+	while(b)
+	{
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	
+	return(a);
+}
+
+static long _period(src_tone_t *src)
+{
+	long long fm;
+	long p, q;
+	int t;
+	
+	switch(src->signal)
+	{
+	case _SILENCE:
+		return(1);
+	
+	case _SWEEP:
+		return(src->period <= MAX_PERIOD ? src->period : -1);
+	
+	case _SINE:
+	case _MULTITONE:
+		/* Tones on a 1 mHz grid repeat exactly after a whole
+		 * number of samples, the LCM over all the tones */
+		for(p = 1, t = 0; t < src->tones; t++)
+		{
+			fm = llround(src->frequency[t] * 1000);
+			if(fabs(src->frequency[t] * 1000 - fm) > 1e-6) return(-1);
+			
+			/* Only the frequency modulo the sample rate matters */
+			fm %= SRC_SAMPLE_RATE * 1000LL;
+			q = SRC_SAMPLE_RATE * 1000L / _gcd(llabs(fm), SRC_SAMPLE_RATE * 1000L);
+			p = p / _gcd(p, q) * q;
+			
+			if(p > MAX_PERIOD) return(-1);
+		}
+		
+		return(p);
+	}
+	
+	/* Noise is never cached */
+	return(-1);
+}
+
+static void _render_period(src_tone_t *src, int16_t *dst, long period)
+{
+	const long long rate = SRC_SAMPLE_RATE * 1000LL;
+	long long phase[SRC_TONE_MAX];
+	long long step[SRC_TONE_MAX];
+	double amp, v;
+	long i;
+	int t;
+	
+	if(src->signal != _SINE && src->signal != _MULTITONE)
+	{
+		_render(src, dst, period);
+		return;
+	}
+	
+	/* Compute the tones exactly, so the period joins up. The
+	 * phase of each is kept in mHz steps, modulo the sample rate */
+	amp = src->level * INT16_MAX / src->tones;
+	
+	for(t = 0; t < src->tones; t++)
+	{
+		step[t] = llround(src->frequency[t] * 1000) % rate;
+		if(step[t] < 0) step[t] += rate;
+		phase[t] = 0;
+	}
+	
+	for(i = 0; i < period; i++)
+	{
+		for(v = 0, t = 0; t < src->tones; t++)
+		{
+			v += sin(2.0 * M_PI * phase[t] / rate);
+			
+			phase[t] += step[t];
+			if(phase[t] >= rate) phase[t] -= rate;
+		}
+		
+		dst[i] = _clip(v * amp);
+	}
+}
+
+static int _src_tone_read(src_tone_t *src, int16_t *audio[2], int audio_step[2])
+{
+	/* Render the next block, unless it's already cached */
+	if(!src->cached)
 	{
-		src->audio[i] = sin(src->x) * src->level * INT16_MAX;
-		src->x += src->delta;
+		_render(src, src->audio, src->audio_len);
 	}
 	
 	/* Map our mono signal to the two stereo track */
@@ -56,20 +309,65 @@ static int _src_tone_close(src_tone_t *src)
 	return(0);
 }
 
-int src_tone_open(src_t *s, double frequency, double level)
+int src_tone_open(src_t *s, const char *signal, const double *frequency, int tones, double level, double duration, unsigned int seed)
 {
 	src_tone_t *src;
+	long period;
+	int i;
 	
 	memset(s, 0, sizeof(src_t));
 	
+	for(i = 0; _signals[i] && strcasecmp(_signals[i], signal) != 0; i++);
+	if(!_signals[i])
+	{
+		fprintf(stderr, "Unrecognised test signal '%s'\n", signal);
+		return(-1);
+	}
+	
+	if(tones < 1 || tones > SRC_TONE_MAX ||
+	   (i == _SWEEP && (tones != 2 || frequency[0] <= 0 || frequency[1] <= 0 || duration <= 0)))
+	{
+		fprintf(stderr, "Invalid test signal frequencies\n");
+		return(-1);
+	}
+	
+	pthread_once(&_sine_once, _init_sine);
+	
 	src = calloc(1, sizeof(src_tone_t));
 	if(!src)
 	{
 		return(-1);
 	}
 	
-	/* Allocate memory for output buffer (1 second) */
-	src->audio_len = SRC_SAMPLE_RATE;
+	src->signal = i;
+	src->level = level;
+	src->tones = tones;
+	
+	/* Configure the oscillators */
+	for(i = 0; i < tones; i++)
+	{
+		src->frequency[i] = frequency[i];
+		src->delta[i] = llround(frequency[i] / SRC_SAMPLE_RATE * 4294967296.0);
+	}
+	
+	src->f0 = frequency[0];
+	src->f1 = frequency[tones > 1 ? 1 : 0];
+	src->period = lround(duration * SRC_SAMPLE_RATE);
+	src->rng = seed ? seed : 1;
+	
+	period = _period(src);
+	
+	if(period > 0)
+	{
+		/* Render whole periods, at least one block long */
+		src->audio_len = period * ((BLOCK + period - 1) / period);
+		src->cached = 1;
+	}
+	else
+	{
+		src->audio_len = BLOCK;
+	}
+	
 	src->audio = malloc(src->audio_len * sizeof(int16_t));
 	if(!src->audio)
 	{
@@ -77,15 +375,21 @@ int src_tone_open(src_t *s, double frequency, double level)
 		return(-1);
 	}
 	
-	/* Configure the sine wave */	
-	src->x = 0;
-	src->delta = 2.0 * M_PI * frequency / SRC_SAMPLE_RATE;
-	src->level = level;
+	if(src->cached)
+	{
+		_render_period(src, src->audio, period);
+		
+		for(i = period; i < src->audio_len; i++)
+		{
+			src->audio[i] = src->audio[i - period];
+		}
+	}
 	
 	/* Register the callback functions */
 	s->private = src;
 	s->read = (src_read_t) _src_tone_read;
 	s->close = (src_close_t) _src_tone_close;
+	s->period = src->cached ? period : 0;
 	
 	return(0);
 }
@@ -18,7 +18,15 @@
 #ifndef _SRC_TONE_H
 #define _SRC_TONE_H
 
-extern int src_tone_open(src_t *s, double frequency, double level);
+/* Test signal generator. Signals are sine, sweep (a logarithmic sweep
+ * between two frequencies over duration seconds), multitone (the sum of
+ * up to SRC_TONE_MAX tones), noise and pink (seeded white and pink noise)
+ * and silence. Signals that repeat within 10 seconds are rendered once
+ * and played from a cache */
+
+#define SRC_TONE_MAX 16
+
+extern int src_tone_open(src_t *s, const char *signal, const double *frequency, int tones, double level, double duration, unsigned int seed);
 
 #endif
 
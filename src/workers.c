@@ -0,0 +1,163 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "workers.h"
+
+static void _work(workers_t *w)
+{
+	int i;
+	
+	while((i = atomic_fetch_add(&w->next, 1)) < w->n)
+	{
+		w->fn(w->arg, i);
+	}
+}
+
+static double _cpu_time(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	
+	return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void *_thread(void *arg)
+{
+	workers_t *w = arg;
+	unsigned int batch = 0;
+	double t;
+	
+	pthread_mutex_lock(&w->mutex);
+	
+	while(1)
+	{
+		while(!w->quit && w->batch == batch)
+		{
+			pthread_cond_wait(&w->start, &w->mutex);
+		}
+		
+		if(w->quit) break;
+		
+		batch = w->batch;
+		pthread_mutex_unlock(&w->mutex);
+		
+		t = _cpu_time();
+		_work(w);
+		t = _cpu_time() - t;
+		
+		pthread_mutex_lock(&w->mutex);
+		
+		w->cpu_time += t;
+		
+		if(--w->running == 0)
+		{
+			pthread_cond_signal(&w->done);
+		}
+	}
+	
+	pthread_mutex_unlock(&w->mutex);
+	
+	return(NULL);
+}
+
+int workers_init(workers_t *w, int threads)
+{
+	memset(w, 0, sizeof(workers_t));
+	
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->start, NULL);
+	pthread_cond_init(&w->done, NULL);
+	atomic_init(&w->next, 0);
+	
+	/* The calling thread does its share of the work */
+	if(threads <= 1) return(0);
+	
+	w->threads = calloc(threads - 1, sizeof(pthread_t));
+	if(!w->threads)
+	{
+		workers_free(w);
+		return(-1);
+	}
+	
+	for(; w->nthreads < threads - 1; w->nthreads++)
+	{
+		if(pthread_create(&w->threads[w->nthreads], NULL, _thread, w) != 0)
+		{
+			workers_free(w);
+			return(-1);
+		}
+	}
+	
+	return(0);
+}
+
+void workers_run(workers_t *w, workers_fn_t fn, void *arg, int n)
+{
+	pthread_mutex_lock(&w->mutex);
+	
+	w->fn = fn;
+	w->arg = arg;
+	w->n = n;
+	atomic_store(&w->next, 0);
+	
+	if(w->nthreads > 0 && n > 1)
+	{
+		w->running = w->nthreads;
+		w->batch++;
+		pthread_cond_broadcast(&w->start);
+	}
+	
+	pthread_mutex_unlock(&w->mutex);
+	
+	_work(w);
+	
+	pthread_mutex_lock(&w->mutex);
+	
+	while(w->running > 0)
+	{
+		pthread_cond_wait(&w->done, &w->mutex);
+	}
+	
+	pthread_mutex_unlock(&w->mutex);
+}
+
+void workers_free(workers_t *w)
+{
+	int i;
+	
+	pthread_mutex_lock(&w->mutex);
+	w->quit = 1;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->mutex);
+	
+	for(i = 0; i < w->nthreads; i++)
+	{
+		pthread_join(w->threads[i], NULL);
+	}
+	
+	free(w->threads);
+	
+	pthread_cond_destroy(&w->done);
+	pthread_cond_destroy(&w->start);
+	pthread_mutex_destroy(&w->mutex);
+	
+	memset(w, 0, sizeof(workers_t));
+}
+
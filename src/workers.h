@@ -0,0 +1,61 @@
+/* dsr - Digitale Satelliten Radio (DSR) encoder                         */
+/*=======================================================================*/
+/* Copyright 2021 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* A small pool of threads for splitting one piece of work into
+ * independent parts. workers_run() calls fn once for each index
+ * 0 .. n-1, spread over the pool and the calling thread, and
+ * returns when every call has finished.
+*/
+
+typedef void (*workers_fn_t)(void *arg, int index);
+
+typedef struct {
+	
+	pthread_t *threads;
+	int nthreads;
+	
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	
+	/* The current batch */
+	workers_fn_t fn;
+	void *arg;
+	int n;
+	atomic_int next;
+	
+	unsigned int batch;
+	int running;
+	int quit;
+	
+	/* CPU time used by the pool threads, in seconds */
+	double cpu_time;
+	
+} workers_t;
+
+extern int workers_init(workers_t *w, int threads);
+extern void workers_run(workers_t *w, workers_fn_t fn, void *arg, int n);
+extern void workers_free(workers_t *w);
+
+#endif
+